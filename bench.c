@@ -0,0 +1,495 @@
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "./proto.h"
+#include "./stats.h"
+
+/*
+ * Load generator for a running server. Each thread drives a connection of
+ * its own, keeping up to depth commands in flight on it: queries for the
+ * given share of its commands and sets (upserts) for the rest, of keys
+ * drawn uniformly, from a Zipfian distribution or in sequence from a fixed
+ * key space, which is set up front so that queries find their keys. The
+ * latency of every command, from sending it to reading its response, goes
+ * into a histogram, and throughput is reported along with the percentiles
+ * of the latencies of queries, of sets and of both.
+ */
+
+#define DEFAULT_CONNS 4
+#define DEFAULT_OPS 100000
+#define DEFAULT_KEYS 100000
+#define DEFAULT_READS 90
+#define DEFAULT_VALUE 16
+#define DEFAULT_DEPTH 1
+#define DEFAULT_THETA 0.99
+#define MAX_DEPTH 1024
+#define MAX_VALUE 256  // The longest value the server stores
+#define KEYLEN 32
+
+// Key distributions
+#define DIST_UNIFORM 0
+#define DIST_ZIPF 1
+#define DIST_SEQ 2
+
+#define READ 0
+#define WRITE 1
+
+typedef struct options {
+    const char *server;
+    const char *port;
+    int conns;
+    long ops;  // Per connection
+    long keys;
+    int dist;
+    int reads;  // Percentage of queries
+    int value_len;
+    int depth;
+    int binary;
+    int preload;
+    int histogram;
+    double theta;
+} options_t;
+
+static options_t opts = {NULL, NULL, DEFAULT_CONNS, DEFAULT_OPS,
+                         DEFAULT_KEYS, DIST_UNIFORM, DEFAULT_READS,
+                         DEFAULT_VALUE, DEFAULT_DEPTH, 1, 1, 0,
+                         DEFAULT_THETA};
+
+// The Zipfian distribution over the key space, as in YCSB (Gray et al.,
+// "Quickly generating billion-record synthetic databases")
+static struct {
+    double alpha;
+    double zetan;
+    double eta;
+} zipf;
+
+static char value[MAX_VALUE + 1];
+
+// A command in flight
+typedef struct inflight {
+    double sent;
+    int type;
+} inflight_t;
+
+// One connection, and the thread driving it
+typedef struct worker {
+    int id;
+    pthread_t thread;
+    int binary;
+    FILE *in;
+    FILE *out;
+    uint64_t rng;
+    long next;    // For DIST_SEQ, the next key
+    long misses;  // Queries of keys not found, and failed sets
+    unsigned long hist[2][STATS_HIST_BUCKETS];  // Like the server's
+} worker_t;
+
+// Returns a socket connected to server on port, or -1 on failure
+static int get_socket(const char *server, const char *port) {
+    int sock = -1;
+    struct addrinfo hints;
+    struct addrinfo *result;
+    struct addrinfo *res;
+    int err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((err = getaddrinfo(server, port, &hints, &result)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+    for (res = result; res != NULL; res = res->ai_next) {
+        if ((sock = socket(res->ai_family, res->ai_socktype,
+                           res->ai_protocol)) < 0) {
+            continue;
+        }
+        if (connect(sock, res->ai_addr, res->ai_addrlen) >= 0) break;
+        close(sock);
+    }
+    freeaddrinfo(result);
+
+    if (res == NULL) {
+        fprintf(stderr, "failed to connect to '%s'\n", server);
+        return -1;
+    }
+    return sock;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what) {
+    fprintf(stderr, "%s: connection terminated\n", what);
+    exit(1);
+}
+
+// xorshift64*, a fast generator good enough to pick keys with
+static uint64_t next_random(worker_t *worker) {
+    worker->rng ^= worker->rng >> 12;
+    worker->rng ^= worker->rng << 25;
+    worker->rng ^= worker->rng >> 27;
+    return worker->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static double next_double(worker_t *worker) {
+    return (next_random(worker) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static void zipf_init(long n, double theta) {
+    double zeta2 = 1 + pow(0.5, theta);
+
+    zipf.zetan = 0;
+    for (long i = 1; i <= n; i++) zipf.zetan += 1 / pow(i, theta);
+    zipf.alpha = 1 / (1 - theta);
+    zipf.eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zipf.zetan);
+}
+
+/* Returns the next key for the worker to use. Zipfian ranks are scattered
+ * over the key space, multiplying by a prime larger than it, so that the
+ * hottest keys are not all neighbours. */
+static long next_key(worker_t *worker) {
+    double u;
+    double uz;
+    long rank;
+
+    switch (opts.dist) {
+        case DIST_SEQ:
+            rank = worker->next;
+            worker->next = (worker->next + 1) % opts.keys;
+            return rank;
+        case DIST_ZIPF:
+            u = next_double(worker);
+            uz = u * zipf.zetan;
+            if (uz < 1) {
+                rank = 0;
+            } else if (uz < 1 + pow(0.5, opts.theta)) {
+                rank = 1;
+            } else {
+                rank = opts.keys * pow(zipf.eta * u - zipf.eta + 1,
+                                       zipf.alpha);
+                if (rank >= opts.keys) rank = opts.keys - 1;
+            }
+            return (long)((uint64_t)rank * 2147483647ULL % opts.keys);
+        default:
+            return next_random(worker) % opts.keys;
+    }
+}
+
+// Sends a query (READ) or a set (WRITE) of key number key
+static void send_command(worker_t *worker, int type, long key) {
+    char name[KEYLEN];
+    unsigned char header[BIN_HEADER_LEN];
+    bin_header_t fields = {type == READ ? 'q' : 's', 0, 0, 0, 0};
+
+    snprintf(name, sizeof(name), "key%010ld", key);
+
+    if (!worker->binary) {
+        if (type == READ) {
+            fprintf(worker->out, "q %s\n", name);
+        } else {
+            fprintf(worker->out, "s %s %s\n", name, value);
+        }
+        return;
+    }
+
+    fields.key_len = strlen(name);
+    fields.value_len = type == WRITE ? (uint32_t)opts.value_len : 0;
+    bin_pack(header, &fields);
+    fwrite(header, 1, BIN_HEADER_LEN, worker->out);
+    fwrite(name, 1, fields.key_len, worker->out);
+    fwrite(value, 1, fields.value_len, worker->out);
+}
+
+// Reads the response to one command, returning 0 unless it reported failure
+static int read_response(worker_t *worker) {
+    char line[BIN_MAX_FRAME];
+    unsigned char header[BIN_HEADER_LEN];
+    bin_header_t fields;
+
+    if (!worker->binary) {
+        if (fgets(line, sizeof(line), worker->in) == NULL) fail("text");
+        return strncmp(line, "not ", 4) == 0 ||
+               strncmp(line, "set failed", 10) == 0 ||
+               strncmp(line, "ill-formed ", 11) == 0;
+    }
+
+    if (fread(header, 1, BIN_HEADER_LEN, worker->in) != BIN_HEADER_LEN) {
+        fail("binary");
+    }
+    bin_unpack(header, &fields);
+    if ((long)fields.key_len + fields.value_len > (long)sizeof(line) ||
+        fread(line, 1, fields.key_len + fields.value_len, worker->in) !=
+            (size_t)fields.key_len + fields.value_len) {
+        fail("binary");
+    }
+    return fields.status != BIN_OK;
+}
+
+// Opens the worker's connection, switching it to the binary protocol if
+// asked to
+static void worker_connect(worker_t *worker) {
+    int sock;
+
+    if ((sock = get_socket(opts.server, opts.port)) < 0) exit(1);
+    if ((worker->in = fdopen(sock, "r")) == NULL ||
+        (worker->out = fdopen(dup(sock), "w")) == NULL) {
+        perror("fdopen");
+        exit(1);
+    }
+
+    worker->binary = opts.binary;
+    if (worker->binary) {
+        fputc(BIN_MAGIC, worker->out);
+        fflush(worker->out);
+        if (fgetc(worker->in) != BIN_MAGIC) {
+            fprintf(stderr, "server does not speak the binary protocol\n");
+            exit(1);
+        }
+    }
+}
+
+// Sets the worker's share of the key space, depth commands at a time
+static void *run_preload(void *arg) {
+    worker_t *worker = (worker_t *)arg;
+    long first = opts.keys * worker->id / opts.conns;
+    long last = opts.keys * (worker->id + 1) / opts.conns;
+    long sent = first;
+    long received = first;
+
+    while (received < last) {
+        while (sent < last && sent - received < opts.depth) {
+            send_command(worker, WRITE, sent++);
+        }
+        fflush(worker->out);
+        if (read_response(worker)) {
+            fprintf(stderr, "failed to set key %ld\n", received);
+            exit(1);
+        }
+        received++;
+    }
+    return NULL;
+}
+
+/* Runs the worker's commands, keeping depth of them in flight. The latency
+ * of a command counts from when it is written out, so includes waiting for
+ * those ahead of it on the connection. */
+static void *run_worker(void *arg) {
+    worker_t *worker = (worker_t *)arg;
+    inflight_t inflight[MAX_DEPTH];
+    long sent = 0;
+    long received = 0;
+    long batch;
+    inflight_t *command;
+    double start;
+
+    while (received < opts.ops) {
+        batch = sent;
+        while (sent < opts.ops && sent - received < opts.depth) {
+            command = &inflight[sent++ % opts.depth];
+            command->type = (long)(next_random(worker) % 100) < opts.reads
+                                ? READ
+                                : WRITE;
+            send_command(worker, command->type, next_key(worker));
+        }
+        if (sent > batch) {
+            start = now();
+            while (batch < sent) inflight[batch++ % opts.depth].sent = start;
+            fflush(worker->out);
+        }
+
+        worker->misses += read_response(worker);
+        command = &inflight[received++ % opts.depth];
+        worker->hist[command->type]
+                    [stats_bucket((now() - command->sent) * 1e9)]++;
+    }
+    return NULL;
+}
+
+// Runs fn on every worker in a thread of its own, returning the time taken
+static double run_all(worker_t *workers, void *(*fn)(void *)) {
+    double start = now();
+    int error;
+
+    for (int i = 0; i < opts.conns; i++) {
+        if ((error = pthread_create(&workers[i].thread, 0, fn,
+                                    &workers[i]))) {
+            errno = error;
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < opts.conns; i++) {
+        if ((error = pthread_join(workers[i].thread, NULL))) {
+            errno = error;
+            perror("pthread_join");
+            exit(1);
+        }
+    }
+    return now() - start;
+}
+
+// Percentiles are worked out as for the server's stats (see stats.h)
+static void report(const char *name, unsigned long *hist) {
+    unsigned long n = 0;
+
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++) n += hist[i];
+    if (n == 0) return;
+
+    printf("%-6s %10lu ops  p50 %9.1f  p99 %9.1f  p999 %9.1f  max %9.1f us\n",
+           name, n, stats_percentile(hist, 0.5), stats_percentile(hist, 0.99),
+           stats_percentile(hist, 0.999), stats_percentile(hist, 1));
+    if (!opts.histogram) return;
+
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+        if (hist[i] > 0) {
+            printf("  %12.1f us %10lu\n", stats_bucket_ns(i) / 1e3, hist[i]);
+        }
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-c conns] [-n ops] [-k keys] "
+            "[-d uniform|zipf|seq] [-z theta]\n"
+            "       [-r read %%] [-v value size] [-p depth] [-t] [-N] [-H] "
+            "<servername> <port>\n",
+            name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    worker_t *workers;
+    unsigned long all[STATS_HIST_BUCKETS];
+    long misses = 0;
+    double elapsed;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:k:d:z:r:v:p:tNH")) != -1) {
+        switch (opt) {
+            case 'c':
+                opts.conns = atoi(optarg);
+                break;
+            case 'n':
+                opts.ops = atol(optarg);
+                break;
+            case 'k':
+                opts.keys = atol(optarg);
+                break;
+            case 'd':
+                if (strcmp(optarg, "uniform") == 0) {
+                    opts.dist = DIST_UNIFORM;
+                } else if (strcmp(optarg, "zipf") == 0) {
+                    opts.dist = DIST_ZIPF;
+                } else if (strcmp(optarg, "seq") == 0) {
+                    opts.dist = DIST_SEQ;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case 'z':
+                opts.theta = atof(optarg);
+                break;
+            case 'r':
+                opts.reads = atoi(optarg);
+                break;
+            case 'v':
+                opts.value_len = atoi(optarg);
+                break;
+            case 'p':
+                opts.depth = atoi(optarg);
+                break;
+            case 't':
+                opts.binary = 0;
+                break;
+            case 'N':
+                opts.preload = 0;
+                break;
+            case 'H':
+                opts.histogram = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2) usage(argv[0]);
+    opts.server = argv[optind];
+    opts.port = argv[optind + 1];
+
+    if (opts.conns < 1 || opts.ops < 1 || opts.keys < 1 || opts.reads < 0 ||
+        opts.reads > 100 || opts.value_len < 1 ||
+        opts.value_len > MAX_VALUE || opts.depth < 1 ||
+        opts.depth > MAX_DEPTH || opts.theta <= 0 || opts.theta >= 1) {
+        fprintf(stderr,
+                "conns, ops and keys must be positive, read %% at most 100, "
+                "value size at most %d, depth at most %d and theta between "
+                "0 and 1\n",
+                MAX_VALUE, MAX_DEPTH);
+        return 1;
+    }
+
+    memset(value, 'v', opts.value_len);
+    if (opts.dist == DIST_ZIPF) zipf_init(opts.keys, opts.theta);
+
+    if ((workers = calloc(opts.conns, sizeof(worker_t))) == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < opts.conns; i++) {
+        workers[i].id = i;
+        workers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        workers[i].next = opts.keys * i / opts.conns;
+        worker_connect(&workers[i]);
+    }
+
+    printf("%d connections, %ld ops each, %d in flight, %ld keys (%s), "
+           "%d%% reads, %d byte values, %s protocol\n",
+           opts.conns, opts.ops, opts.depth, opts.keys,
+           opts.dist == DIST_ZIPF  ? "zipf"
+           : opts.dist == DIST_SEQ ? "seq"
+                                   : "uniform",
+           opts.reads, opts.value_len, opts.binary ? "binary" : "text");
+
+    if (opts.preload) {
+        elapsed = run_all(workers, run_preload);
+        printf("preload %10.0f ops/sec\n", opts.keys / elapsed);
+    }
+
+    elapsed = run_all(workers, run_worker);
+    printf("run     %10.0f ops/sec\n", opts.conns * opts.ops / elapsed);
+
+    // Adding every worker's histograms into the first one's
+    for (int i = 0; i < opts.conns; i++) {
+        for (int b = 0; i > 0 && b < STATS_HIST_BUCKETS; b++) {
+            workers[0].hist[READ][b] += workers[i].hist[READ][b];
+            workers[0].hist[WRITE][b] += workers[i].hist[WRITE][b];
+        }
+        misses += workers[i].misses;
+        fclose(workers[i].out);
+        fclose(workers[i].in);
+    }
+    for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+        all[b] = workers[0].hist[READ][b] + workers[0].hist[WRITE][b];
+    }
+
+    report("query", workers[0].hist[READ]);
+    report("set", workers[0].hist[WRITE]);
+    report("all", all);
+    if (misses > 0) printf("%ld commands failed or missed\n", misses);
+
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,234 @@
+#include "./cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+// How many times a lookup reads a bucket that keeps changing under it
+// before giving up and calling it a miss
+#define CACHE_RETRIES 4
+
+typedef struct cache_entry {
+    unsigned long hash;
+    unsigned short name_len;  // 0 for an empty entry, no key is empty
+    unsigned short value_len;
+    unsigned char referenced;  // Hit since the clock hand last went past
+    char data[CACHE_DATA];     // The name and then the value, unterminated
+} cache_entry_t;
+
+typedef struct cache_bucket {
+    unsigned long version;        // Odd while the bucket is being changed
+    unsigned long invalidations;  // Keys of the bucket invalidated so far
+    unsigned int hand;            // Next entry the clock looks at
+    cache_entry_t entries[CACHE_WAYS];
+} cache_bucket_t;
+
+// NULL while the cache is disabled
+static cache_bucket_t *buckets;
+static unsigned long num_buckets;  // A power of two
+
+// FNV-1a, over 64 bits
+static unsigned long cache_hash(const char *name, size_t len) {
+    unsigned long hash = 14695981039346656037UL;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static cache_bucket_t *bucket_of(unsigned long hash) {
+    return &buckets[hash & (num_buckets - 1)];
+}
+
+// Takes a bucket's lock, which is its version being odd, and returns the
+// version it had
+static unsigned long bucket_lock(cache_bucket_t *bucket) {
+    unsigned long version;
+
+    while (1) {
+        version = __atomic_load_n(&bucket->version, __ATOMIC_RELAXED);
+        if ((version & 1) == 0 &&
+            __atomic_compare_exchange_n(&bucket->version, &version,
+                                        version + 1, 0, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    // Lookups must see the version change before any change to the bucket
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return version;
+}
+
+static void bucket_unlock(cache_bucket_t *bucket, unsigned long version) {
+    __atomic_store_n(&bucket->version, version + 2, __ATOMIC_RELEASE);
+}
+
+// The entry of a locked bucket holding name, or NULL if there is none
+static cache_entry_t *bucket_find(cache_bucket_t *bucket, unsigned long hash,
+                                  const char *name, size_t len) {
+    cache_entry_t *entry;
+
+    for (int i = 0; i < CACHE_WAYS; i++) {
+        entry = &bucket->entries[i];
+        if (entry->hash == hash && entry->name_len == len &&
+            memcmp(entry->data, name, len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Sets the cache up to take about bytes of memory (at least a bucket's
+ * worth), or leaves it disabled if bytes is 0. Must be called before the
+ * database is first used. Returns 0, or -1 if memory runs out. */
+int cache_init(size_t bytes) {
+    if (bytes == 0) return 0;
+
+    num_buckets = 1;
+    while (2 * num_buckets * sizeof(cache_bucket_t) <= bytes) num_buckets *= 2;
+    if ((buckets = calloc(num_buckets, sizeof(cache_bucket_t))) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+int cache_enabled(void) {
+    return buckets != NULL;
+}
+
+// How many keys the cache can hold, 0 if it is disabled
+size_t cache_capacity(void) {
+    return buckets != NULL ? num_buckets * CACHE_WAYS : 0;
+}
+
+/* Looks name, of length len, up, copying up to result_len-1 bytes of its
+ * value to result, NUL terminated. Returns the length of what was copied,
+ * or -1 on a miss, in which case *generation is set for cache_put: the value
+ * must be read from the tree after this call for it to be cached. */
+int cache_get(const char *name, size_t len, char *result, int result_len,
+              unsigned long *generation) {
+    unsigned long hash = cache_hash(name, len);
+    cache_bucket_t *bucket = bucket_of(hash);
+    cache_entry_t *entry;
+    unsigned long version;
+    int found;
+    int n = 0;
+
+    // Read first, so that an invalidation made since cannot be missed
+    *generation = __atomic_load_n(&bucket->invalidations, __ATOMIC_ACQUIRE);
+
+    for (int attempt = 0; attempt < CACHE_RETRIES; attempt++) {
+        version = __atomic_load_n(&bucket->version, __ATOMIC_ACQUIRE);
+        if (version & 1) continue;
+
+        // Entries may change while they are read, in which case the version
+        // does too, and whatever was read is thrown away
+        found = 0;
+        for (int i = 0; i < CACHE_WAYS && !found; i++) {
+            entry = &bucket->entries[i];
+            if (entry->hash != hash || entry->name_len != len ||
+                entry->name_len + entry->value_len > CACHE_DATA ||
+                memcmp(entry->data, name, len) != 0) {
+                continue;
+            }
+            n = entry->value_len < result_len - 1 ? entry->value_len
+                                                  : result_len - 1;
+            memcpy(result, &entry->data[len], n);
+            found = 1;
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&bucket->version, __ATOMIC_RELAXED) != version) {
+            continue;
+        }
+        if (!found) return -1;
+
+        result[n] = '\0';
+        if (!__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+        }
+        return n;
+    }
+    return -1;
+}
+
+/* Caches value, of length value_len, as the value of name, unless a key of
+ * its bucket was invalidated since the cache_get that returned generation,
+ * in which case value may already be out of date. */
+void cache_put(const char *name, size_t len, const char *value,
+               size_t value_len, unsigned long generation) {
+    unsigned long hash;
+    cache_bucket_t *bucket;
+    cache_entry_t *entry;
+    unsigned long version;
+
+    if (buckets == NULL || len == 0 || len + value_len > CACHE_DATA) return;
+
+    hash = cache_hash(name, len);
+    bucket = bucket_of(hash);
+    version = bucket_lock(bucket);
+    if (bucket->invalidations != generation ||
+        bucket_find(bucket, hash, name, len) != NULL) {
+        bucket_unlock(bucket, version);
+        return;
+    }
+
+    // Sweeping for an entry that is empty or was not hit since the last
+    // sweep, clearing the marks of those that were on the way
+    while (1) {
+        entry = &bucket->entries[bucket->hand];
+        bucket->hand = (bucket->hand + 1) % CACHE_WAYS;
+        if (entry->name_len == 0 ||
+            !__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED)) {
+            break;
+        }
+        __atomic_store_n(&entry->referenced, 0, __ATOMIC_RELAXED);
+    }
+
+    entry->hash = hash;
+    entry->name_len = len;
+    entry->value_len = value_len;
+    entry->referenced = 0;
+    memcpy(entry->data, name, len);
+    memcpy(&entry->data[len], value, value_len);
+    bucket_unlock(bucket, version);
+}
+
+/* Drops name from the cache, if it is there, and keeps values of its bucket
+ * read from the tree before now out of it. Called by writers once their
+ * change to name is made in the tree. */
+void cache_invalidate(const char *name, size_t len) {
+    unsigned long hash;
+    cache_bucket_t *bucket;
+    cache_entry_t *entry;
+    unsigned long version;
+
+    if (buckets == NULL) return;
+
+    hash = cache_hash(name, len);
+    bucket = bucket_of(hash);
+    version = bucket_lock(bucket);
+    __atomic_store_n(&bucket->invalidations, bucket->invalidations + 1,
+                     __ATOMIC_RELEASE);
+    if ((entry = bucket_find(bucket, hash, name, len)) != NULL) {
+        entry->name_len = 0;
+    }
+    bucket_unlock(bucket, version);
+}
+
+// Drops every key from the cache, as cache_invalidate does each one
+void cache_clear(void) {
+    cache_bucket_t *bucket;
+    unsigned long version;
+
+    for (unsigned long i = 0; i < num_buckets && buckets != NULL; i++) {
+        bucket = &buckets[i];
+        version = bucket_lock(bucket);
+        __atomic_store_n(&bucket->invalidations, bucket->invalidations + 1,
+                         __ATOMIC_RELEASE);
+        for (int j = 0; j < CACHE_WAYS; j++) {
+            bucket->entries[j].name_len = 0;
+        }
+        bucket_unlock(bucket, version);
+    }
+}
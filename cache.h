@@ -0,0 +1,41 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stddef.h>
+
+/*
+ * A cache of the values of recently queried keys, in front of the tree, so
+ * that a query for a popular key is answered without walking down to it.
+ * The cache is a hash table split into buckets of CACHE_WAYS entries, each
+ * key having a single bucket it can be cached in, from which entries are
+ * evicted by the CLOCK algorithm: a hit marks its entry as referenced, and
+ * room is made by sweeping the bucket for an entry that has not been since
+ * the last sweep went past.
+ *
+ * Lookups take no locks, but read a bucket optimistically and check its
+ * version afterwards, like queries do the tree (see search_optimistic in
+ * db.c); only filling and invalidating entries lock their bucket. Writers
+ * invalidate a key once their change to the tree is made, and a value read
+ * from the tree is only cached if no key of its bucket was invalidated in
+ * between (see cache_get), so the cache never holds a value older than the
+ * tree's.
+ */
+
+// Entries per bucket
+#define CACHE_WAYS 8
+
+// Bytes of a key and its value together that an entry can hold. Longer
+// ones are never cached.
+#define CACHE_DATA 112
+
+int cache_init(size_t bytes);
+int cache_enabled(void);
+int cache_get(const char *name, size_t len, char *result, int result_len,
+              unsigned long *generation);
+void cache_put(const char *name, size_t len, const char *value,
+               size_t value_len, unsigned long generation);
+void cache_invalidate(const char *name, size_t len);
+void cache_clear(void);
+size_t cache_capacity(void);
+
+#endif  // CACHE_H_
@@ -1,4 +1,5 @@
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -14,6 +15,10 @@
 
 #define BUFSIZE 1024
 
+// Upper bound on how many commands may await their responses at once, which
+// keeps a client and the server from both blocking on full socket buffers
+#define MAX_DEPTH 1024
+
 /*
  * Helper that opens a TCP socket representing the server.
  * Returns the file descriptor on success, -1 on failure.
@@ -57,13 +62,32 @@ int get_socket(const char *server, const char *port) {
     return sock;
 }
 
+// Kinds of response, by how many lines they take
+#define RESPONSE_LINE 0   // A single line
+#define RESPONSE_ITEMS 1  // A line counting the "key value" lines after it
+#define RESPONSE_STATS 2  // Lines up to and including "end of stats"
+
+// The kind of response a command gets. Trailing whitespace is ignored, as
+// the server does when it recognizes the stats command.
+static char response_kind(const char *command) {
+    size_t len = strlen(command);
+
+    while (len > 0 && isspace((unsigned char)command[len - 1])) len--;
+    if (command[0] == 'r' || strncmp(command, "mq", 2) == 0) {
+        return RESPONSE_ITEMS;
+    }
+    if (len == 5 && strncmp(command, "stats", 5) == 0) return RESPONSE_STATS;
+    return RESPONSE_LINE;
+}
+
 /*
  * Forks off a process that attempts to connect to the server, and then run the
- * script in the file provided.
+ * script in the file provided, sending up to depth commands ahead of their
+ * responses.
  * Returns the pid of the child process.
  */
 pid_t create_occurence(const char *server, const char *port,
-                       const char *script) {
+                       const char *script, int depth) {
     pid_t pid;
 
     // create a process for the client
@@ -85,36 +109,73 @@ pid_t create_occurence(const char *server, const char *port,
             exit(1);
         }
 
-        // Step 4: loop, sending queries and printing responses
-        FILE *cxn = fdopen(sock, "w+");
-        char rbuf[BUFSIZE], qbuf[BUFSIZE];
+        // Step 4: loop, sending queries and printing responses. Reading
+        // and writing go through separate streams, since responses to
+        // pipelined commands may be buffered while more commands are sent.
+        FILE *cxn_in = fdopen(sock, "r");
+        FILE *cxn_out = fdopen(dup(sock), "w");
+        char rbuf[BUFSIZE];
+        char *qbuf = NULL;  // Read whole, however long (see getline)
+        size_t qbuf_len = 0;
+        ssize_t qlen;
+        char kinds[MAX_DEPTH];  // Responses awaited, see response_kind
+        int sent = 0, received = 0, done = 0;
         rbuf[0] = '\0';
 
+        if (cxn_in == NULL || cxn_out == NULL) {
+            perror("fdopen");
+            exit(1);
+        }
+
         while (1) {
+            // send commands until depth of them await their responses
+            while (!done && sent - received < depth) {
+                // A last line without a newline gets one, or the server
+                // would wait for the rest of it
+                if ((qlen = getline(&qbuf, &qbuf_len, infile)) < 0) {
+                    done = 1;
+                } else if (fputs(qbuf, cxn_out) == EOF ||
+                           (qbuf[qlen - 1] != '\n' &&
+                            fputc('\n', cxn_out) == EOF)) {
+                    fprintf(stderr, "No connection!\n");
+                    exit(1);
+                } else {
+                    kinds[sent++ % depth] = response_kind(qbuf);
+                }
+            }
+
             // if there are no more commands, so we can clean up and exit
-            if (fgets(qbuf, sizeof(qbuf), infile) == NULL) {
-                qbuf[0] = EOF;
-                fputs(qbuf, cxn);
-                fflush(cxn);
-                fclose(cxn);
+            if (sent == received) {
+                fputc(EOF, cxn_out);
+                fflush(cxn_out);
+                fclose(cxn_out);
+                fclose(cxn_in);
                 fclose(infile);
                 printf("Client terminated cleanly.\n");
                 exit(0);
-            } else {
-                // otherwise, send the command
-                if (fputs(qbuf, cxn) == EOF) {
-                    fprintf(stderr, "No connection!\n");
+            }
+            fflush(cxn_out);
+
+            // wait for the oldest response and print it, all of it for a
+            // range scan, batch query or statistics. The first line of a
+            // range scan or batch query starts with the number of lines
+            // after it, unless it is an error.
+            char kind = kinds[received++ % depth];
+            int lines = 1;
+            for (int i = 0; i < lines; i++) {
+                if (fgets(rbuf, BUFSIZE, cxn_in) == NULL) {
+                    fprintf(stderr, "Connection terminated.\n");
                     exit(1);
                 }
-                fflush(cxn);
-            }
-
-            // wait for the response and print it
-            if (fgets(rbuf, BUFSIZE, cxn) == NULL) {
-                fprintf(stderr, "Connection terminated.\n");
-                exit(1);
+                printf("%s", rbuf);
+                if (i == 0 && kind == RESPONSE_ITEMS &&
+                    sscanf(rbuf, "%d", &lines) == 1) {
+                    lines++;
+                } else if (kind == RESPONSE_STATS &&
+                           strcmp(rbuf, "end of stats\n") != 0) {
+                    lines++;
+                }
             }
-            printf("%s", rbuf);
         }
     }
 
@@ -128,13 +189,15 @@ pid_t create_occurence(const char *server, const char *port,
 void usage_error(const char *cmd) {
     fprintf(stderr,
             "Usage: %s <servername> <port> "
-            "[<script> <occurences>]\n",
+            "[<script> <occurences> [<depth>]]\n",
             cmd);
 }
 
 /*
  * The arguments to the client should be servername, port number,
- * [script-file, number of occurences].
+ * [script-file, number of occurences, [pipelining depth]]. With a depth
+ * greater than 1 (at most MAX_DEPTH), each client sends that many commands
+ * ahead of their responses rather than waiting for every response in turn.
  *
  * Step 1: fork to create as many clients as number of occurences argument
  *
@@ -147,24 +210,31 @@ void usage_error(const char *cmd) {
  */
 int main(int argc, const char *argv[]) {
     // parse args
-    if (argc != 3 && argc != 5) {
+    if (argc != 3 && argc != 5 && argc != 6) {
         usage_error(argv[0]);
         return 1;
     }
 
-    int i, occurences = 1;
+    int i, occurences = 1, depth = 1;
     const char *script = NULL;
     const char *server = argv[1];
     const char *port = argv[2];
 
-    if (argc == 5) {
+    if (argc >= 5) {
         script = argv[3];
         occurences = atoi(argv[4]);
     }
+    if (argc == 6) {
+        depth = atoi(argv[5]);
+        if (depth < 1 || depth > MAX_DEPTH) {
+            usage_error(argv[0]);
+            return 1;
+        }
+    }
 
     // Step 1: create clients, they'll do the rest
     for (i = 0; i < occurences; i++) {
-        if (create_occurence(server, port, script) == -1) {
+        if (create_occurence(server, port, script, depth) == -1) {
             perror("Error forking off process");
             return 1;
         }
@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -14,15 +16,26 @@
 
 int lsock;
 
-static void *listener(void (*server)(FILE *));
+static void *listener(void (*server)(conn_t *));
 
 static int comm_port;
 
-pthread_t start_listener(int port, void (*server)(FILE *)) {
+// The epoll instance watching every client connection
+static int epfd;
+
+/* Starts the thread accepting connections on the given port, which hands
+ * each new connection to server. Connections are only watched for input
+ * once passed to comm_watch. */
+pthread_t start_listener(int port, void (*server)(conn_t *)) {
     comm_port = port;
     pthread_t tid;
     int err;
 
+    if ((epfd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
     if ((err = pthread_create(&tid, 0, (void *(*)(void *))listener,
                               (void *)server)))
         handle_error_en(err, "pthread_create");
@@ -32,7 +45,31 @@ pthread_t start_listener(int port, void (*server)(FILE *)) {
     return tid;
 }
 
-void *listener(void (*server)(FILE *)) {
+// Sets up a connection for the given socket, or returns NULL on failure
+conn_t *conn_constructor(int csock) {
+    conn_t *conn;
+
+    if (fcntl(csock, F_SETFL, fcntl(csock, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        return NULL;
+    }
+    if ((conn = malloc(sizeof(conn_t))) == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    conn->fd = csock;
+    conn->watched = 0;
+    conn->protocol = CONN_NEW;
+    outbuf_init(&conn->out);
+    conn->in_start = 0;
+    conn->in_end = 0;
+    conn->skipping = 0;
+    conn->data = NULL;
+    return conn;
+}
+
+void *listener(void (*server)(conn_t *)) {
     if ((lsock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket");
         exit(1);
@@ -72,35 +109,210 @@ void *listener(void (*server)(FILE *)) {
         fprintf(stderr, "received connection from %s#%hu\n",
                 inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
 
-        FILE *cxstr;
-        if (!(cxstr = fdopen(csock, "w+"))) {
-            perror("fdopen");
+        conn_t *conn;
+        if ((conn = conn_constructor(csock)) == NULL) {
             if (close(csock) < 0) perror("close");
             continue;
         }
 
-        server(cxstr);
+        server(conn);
     }
 
     return NULL;
 }
 
-void comm_shutdown(FILE *cxstr) {
-    if (fclose(cxstr) < 0) perror("fclose");
+/* Has the connection reported by comm_wait once it is ready for
+ * comm_serve: when input arrives or, if it has output pending, when the
+ * socket can take more of it. Reading is held off while output is pending,
+ * so a client that does not read its responses cannot make them pile up. */
+void comm_watch(conn_t *conn) {
+    struct epoll_event event;
+    int op = conn->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    // A worker may pick the connection up as soon as it is added
+    conn->watched = 1;
+
+    event.events = EPOLLONESHOT;
+    event.events |= outbuf_pending(&conn->out) ? EPOLLOUT : EPOLLIN;
+    event.data.ptr = conn;
+    if (epoll_ctl(epfd, op, conn->fd, &event) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
 }
 
-int comm_serve(FILE *cxstr, char *response, char *command) {
-    if (strlen(response) > 0) {
-        if (fputs(response, cxstr) == EOF || fputc('\n', cxstr) == EOF ||
-            fflush(cxstr) == EOF) {
+/* Blocks until a watched connection is ready and returns it. It is no
+ * longer watched until passed to comm_watch again, so only the caller
+ * serves it in the meantime. This is a cancellation point. */
+conn_t *comm_wait(void) {
+    struct epoll_event event;
+    int ret;
+
+    while ((ret = epoll_wait(epfd, &event, 1, -1)) != 1) {
+        if (ret < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+    }
+    return (conn_t *)event.data.ptr;
+}
+
+void comm_shutdown(conn_t *conn) {
+    if (conn->watched && epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL) < 0) {
+        perror("epoll_ctl");
+    }
+    if (close(conn->fd) < 0) perror("close");
+    outbuf_destroy(&conn->out);
+    free(conn);
+}
+
+// Returns the end of the first complete command in the buffered input, or
+// NULL if there is none. Text commands are lines, just past whose newline
+// they end; a line that fills the buffer without ending is too long to be a
+// command. Binary commands are frames, which are checked to fit in the
+// buffer. Either sets *bad if the command does not fit.
+static char *conn_command_end(conn_t *conn, int *bad) {
+    int len = conn->in_end - conn->in_start;
+    char *newline;
+    bin_header_t header;
+    long frame_len;
+
+    if (conn->protocol == CONN_BINARY) {
+        if (len < BIN_HEADER_LEN) return NULL;
+        bin_unpack((unsigned char *)&conn->in[conn->in_start], &header);
+        frame_len = (long)BIN_HEADER_LEN + header.key_len + header.value_len;
+        if (frame_len > CONN_BUFLEN) {
+            *bad = 1;
+            return NULL;
+        }
+        return len >= frame_len ? &conn->in[conn->in_start + frame_len] : NULL;
+    }
+
+    if ((newline = memchr(&conn->in[conn->in_start], '\n', len)) != NULL) {
+        return newline + 1;
+    }
+    if (len == CONN_BUFLEN) *bad = 1;
+    return NULL;
+}
+
+// Drops the buffered part of a line too long to be a command, up to and
+// including its newline if it has come
+static void conn_skip_line(conn_t *conn) {
+    char *newline = memchr(&conn->in[conn->in_start], '\n',
+                           conn->in_end - conn->in_start);
+
+    if (newline == NULL) {
+        conn->in_start = conn->in_end;
+    } else {
+        conn->in_start = newline + 1 - conn->in;
+        conn->skipping = 0;
+    }
+}
+
+// Whether a whole command is buffered, so that the next comm_serve hands it
+// out before sending the responses so far
+int comm_ready(conn_t *conn) {
+    int bad = 0;
+
+    return conn->protocol != CONN_NEW && !conn->skipping &&
+           conn_command_end(conn, &bad) != NULL;
+}
+
+/* Reads the next command, leaving it in place in the connection's input
+ * buffer, where *command points to it until the next call. A text command is
+ * a line of at most CONN_BUFLEN bytes, newline included, and is handed out
+ * NUL terminated instead; a longer line is answered with CONN_TOO_LONG and
+ * dropped whole. A binary command is a whole frame.
+ *
+ * The first byte received decides which protocol the connection speaks: if
+ * it is BIN_MAGIC, it is echoed back and binary frames follow.
+ *
+ * Responses are written to conn->out, and only sent once no further command
+ * has been received, so a client that pipelines its commands gets the
+ * responses to a whole batch of them in a single writev.
+ *
+ * Never blocks: returns 1 if no complete command can be read until more
+ * input arrives or pending output is sent, in which case the connection
+ * should be passed to comm_watch. Returns 0 when a command was read, or -1
+ * once the connection is closed or broken. */
+int comm_serve(conn_t *conn, char **command) {
+    char magic = BIN_MAGIC;
+    char *end;
+    ssize_t ret;
+    int bad = 0;
+
+    while (1) {
+        if (conn->protocol == CONN_NEW && conn->in_end > conn->in_start) {
+            if (conn->in[conn->in_start] == magic) {
+                conn->protocol = CONN_BINARY;
+                conn->in_start++;
+                outbuf_write(&conn->out, &magic, 1);
+            } else {
+                conn->protocol = CONN_TEXT;
+            }
+        }
+
+        if (conn->skipping) conn_skip_line(conn);
+        if ((end = conn_command_end(conn, &bad)) != NULL) break;
+        if (bad && conn->protocol == CONN_TEXT) {
+            // Answering the line once, and dropping the rest of it as it
+            // comes rather than reading it as more commands
+            outbuf_write(&conn->out, CONN_TOO_LONG, strlen(CONN_TOO_LONG));
+            conn->in_start = conn->in_end;
+            conn->skipping = 1;
+            bad = 0;
+            continue;
+        }
+        if (bad) {
+            fprintf(stderr, "client sent an oversized frame\n");
+            return -1;
+        }
+
+        // About to wait for more commands, sending the responses so far
+        if (outbuf_send(&conn->out, conn->fd) < 0) {
             fprintf(stderr, "client connection terminated\n");
             return -1;
         }
+        if (outbuf_pending(&conn->out)) return 1;
+
+        // Making room at the end of the buffer
+        memmove(conn->in, &conn->in[conn->in_start],
+                conn->in_end - conn->in_start);
+        conn->in_end -= conn->in_start;
+        conn->in_start = 0;
+
+        ret = read(conn->fd, &conn->in[conn->in_end],
+                   CONN_BUFLEN - conn->in_end);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+        if (ret <= 0) {
+            // Like fgets, handing over a last line that has no newline
+            if (ret == 0 && conn->in_end > 0 &&
+                conn->protocol == CONN_TEXT) {
+                end = &conn->in[conn->in_end];
+                break;
+            }
+            fprintf(stderr, "client connection terminated\n");
+            return -1;
+        }
+        conn->in_end += ret;
     }
 
-    if (fgets(command, BUFLEN, cxstr) == NULL) {
-        fprintf(stderr, "client connection terminated\n");
-        return -1;
+    *command = &conn->in[conn->in_start];
+    conn->in_start = end - conn->in;
+
+    if (conn->protocol == CONN_TEXT) {
+        if (end[-1] == '\n') {
+            end[-1] = '\0';
+        } else {
+            // The line ends the input without a newline, and may fill the
+            // buffer: the rest of the input, if any, is shifted to make room
+            // for the terminator (in has a byte to spare)
+            memmove(end + 1, end, &conn->in[conn->in_end] - end);
+            conn->in_end++;
+            conn->in_start++;
+            *end = '\0';
+        }
     }
 
     return 0;
@@ -4,8 +4,9 @@
 #include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
+#include "./outbuf.h"
+#include "./proto.h"
 
-#define BUFLEN 256
 #define handle_error_en(en, msg) \
     do {                         \
         errno = en;              \
@@ -13,8 +14,42 @@
         exit(EXIT_FAILURE);      \
     } while (0)
 
-pthread_t start_listener(int port, void (*serve_func)(FILE *));
-void comm_shutdown(FILE *cxstr);
-int comm_serve(FILE *cxstr, char *resp, char *cmd);
+// Size of the buffer commands are read into, which fits any binary frame
+// and any text line up to this long, newline included
+#define CONN_BUFLEN BIN_MAX_FRAME
+
+// The response to a text line too long to fit
+#define CONN_TOO_LONG "command too long\n"
+
+// Protocols a connection may speak (see proto.h)
+#define CONN_NEW 0  // Nothing received yet
+#define CONN_TEXT 1
+#define CONN_BINARY 2
+
+/*
+ * A client connection. Its socket is non-blocking and watched by a single
+ * epoll instance shared by all worker threads (see comm_wait). Commands are
+ * read into a buffer of our own and handed out in place, and responses are
+ * formatted straight into the out buffer until the socket takes them.
+ */
+typedef struct conn {
+    int fd;
+    int watched;  // Whether fd has been added to the epoll instance
+    int protocol;
+    outbuf_t out;
+    char in[CONN_BUFLEN + 1];  // With room to terminate the last command
+    int in_start;  // Unread input is in[in_start..in_end)
+    int in_end;
+    int skipping;  // Dropping the rest of a line too long to fit
+    void *data;  // Left to the server
+} conn_t;
+
+pthread_t start_listener(int port, void (*serve_func)(conn_t *));
+conn_t *conn_constructor(int csock);
+void comm_watch(conn_t *conn);
+conn_t *comm_wait(void);
+void comm_shutdown(conn_t *conn);
+int comm_ready(conn_t *conn);
+int comm_serve(conn_t *conn, char **command);
 
 #endif  // COMM_H_
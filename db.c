@@ -1,223 +1,1081 @@
 #include "./db.h"
+#include "./cache.h"
+#include "./epoch.h"
+#include "./mapped.h"
+#include "./proto.h"
+#include "./slab.h"
+#include "./stats.h"
+#include "./wal.h"
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define MAXLEN 256
 
+// Bytes taken by a node whose name and value have the given lengths
+#define NODE_SIZE(name_len, value_len) \
+    (sizeof(node_t) + (name_len) + (value_len) + 2)
+
+// Every node must fit in the slab allocator's largest size class
+_Static_assert(NODE_SIZE(MAXLEN, MAXLEN) <= SLAB_MAX_SIZE,
+               "nodes with the longest names and values must fit in a slab");
+
+// Upper bound on the height of the tree. An AVL tree this tall would hold far
+// more nodes than fit in memory, so this also bounds how many locks a writer
+// holds at once.
+#define MAX_HEIGHT 64
+
+// Upper bound on the number of shards the keys can be split into
+#define MAX_SHARDS 1024
+
+// How many times a writer retries upgrading its anchor after the subtree
+// below it changed, before write locking the whole path from the head.
+#define MAX_ANCHOR_RETRIES 3
+
+// How many times a lock-free lookup is restarted after running into a
+// concurrent change, before falling back to hand-over-hand read locking.
+#define MAX_OPTIMISTIC_RETRIES 8
+
+// How many keys a range scan collects before letting go of its locks and
+// handing them over
+#define SCAN_BATCH 64
+
+// Most words a batch command may have: every word of a text command line
+// (up to CONN_BUFLEN, in comm.h, which is BIN_MAX_FRAME) takes at least
+// two bytes, counting the space or newline after it
+#define MAX_BATCH (BIN_MAX_FRAME / 2)
+
+// Bits of node_t.version. A node's version is bumped around every change
+// that may move keys out of its subtree, and marked unlinked for good once
+// the node is removed from the tree.
+#define VERSION_CHANGING 1UL
+#define VERSION_UNLINKED 2UL
+#define VERSION_INCREMENT 4UL
+
+// Child pointers are followed by lock-free readers, so writers publish them
+// atomically, after the node they point to has been initialized
+#define load_child(slot) __atomic_load_n(&(slot), __ATOMIC_ACQUIRE)
+#define store_child(slot, node) \
+    __atomic_store_n(&(slot), (node), __ATOMIC_RELEASE)
+
 // The root node of the binary tree, unlike all
 // other nodes in the tree, this one is never
 // freed (it's allocated in the data region).
-node_t head = {"", "", 0, 0, PTHREAD_RWLOCK_INITIALIZER};
+static node_t default_head = {
+    .name = "", .value = "", .lock = PTHREAD_RWLOCK_INITIALIZER};
+
+// The keys are split by hash into num_shards independent trees, each with its
+// own head (see db_init). Head nodes have an empty name, which sorts before
+// every key, so each tree hangs off its head's right child.
+static node_t *heads = &default_head;
+static int num_shards = 1;
+
+// The count of keys (see db_count) when the database was last cleaned up
+static long keys_cleaned;
+
+// How many leading bytes of a key are kept in node_t.prefix
+#define PREFIX_LEN ((int)sizeof(unsigned long))
+
+// A key being looked up, along with its length and prefix, which are worked
+// out once per operation rather than at every node
+typedef struct key {
+    char *name;
+    size_t len;
+    unsigned long prefix;
+} db_key_t;
+
+// Packs the first PREFIX_LEN bytes of name, zero padded, most significant
+// byte first, so that comparing prefixes as numbers orders them like strcmp
+static unsigned long key_prefix(const char *name) {
+    unsigned long prefix = 0;
+
+    for (int i = 0; i < PREFIX_LEN; i++) {
+        prefix <<= 8;
+        if (*name != '\0') prefix |= (unsigned char)*name++;
+    }
+    return prefix;
+}
+
+static void key_init(db_key_t *key, char *name) {
+    key->name = name;
+    key->len = strlen(name);
+    key->prefix = key_prefix(name);
+}
+
+/* Compares key with the name of node like strcmp. Most comparisons are
+ * settled by the prefixes, which are stored in the node itself, without
+ * touching the bytes of the name. Equal prefixes with a key shorter than
+ * PREFIX_LEN mean that both names end at the same byte. */
+static int key_compare(db_key_t *key, node_t *node) {
+    if (key->prefix != node->prefix) return key->prefix < node->prefix ? -1 : 1;
+    if (key->len < PREFIX_LEN) return 0;
+    return strcmp(key->name + PREFIX_LEN, node->name + PREFIX_LEN);
+}
+
+/*
+ * The tree is kept height balanced (AVL): the heights of the two subtrees of
+ * every node differ by at most one, so the tree stays O(log n) deep even when
+ * keys are added in sorted order.
+ *
+ * Readers use hand-over-hand read locking. Writers first descend the same
+ * way, looking for the deepest "safe" node on their way: one whose height
+ * cannot change as a result of the operation, so that nothing above it will
+ * be touched. Only that node (the anchor) is then upgraded to a write lock,
+ * and writers use hand-over-hand write locking below it, keeping every node
+ * whose height may change (and the parent of any node that may be rotated)
+ * locked on a path_t. Meeting another safe node on the way releases every
+ * lock above it. Once the tree has been modified the held path is
+ * rebalanced bottom-up. Writers touching disjoint subtrees therefore only
+ * share read locks near the root.
+ *
+ * As a consequence, a node's height only changes while its parent is write
+ * locked, so the heights of a locked node's children can be read without
+ * locking them. Keys never change once a node is in the tree, but values
+ * may, under the node's write lock (see db_update).
+ *
+ * db_query takes no locks at all (see search_optimistic): it validates each
+ * step against the nodes' versions instead, and removed nodes are only freed
+ * once no such reader can still be looking at them (see epoch.c).
+ */
+
+// The write locked nodes held by a writer, from the top down. Every node in
+// the path is the parent of the next one.
+typedef struct path {
+    node_t *nodes[MAX_HEIGHT + 2];
+    int len;
+} path_t;
+
+#ifdef LOCK_PROFILE
+// The locks the calling thread holds, with when it took them, so that
+// unlock_node can tell how long each was held. A thread holds at most a path
+// and a few nodes beside it, except while dumping the tree (see db_dump):
+// locks taken past PROFILE_HELD are counted but their hold time is not.
+#define PROFILE_HELD (2 * MAX_HEIGHT + 4)
+
+typedef struct held_lock {
+    node_t *node;
+    unsigned long long start;
+    stats_lock_level_t *level;  // Where the hold time is counted
+} held_lock_t;
+
+static __thread held_lock_t held_locks[PROFILE_HELD];
+static __thread int num_held;
+
+/* Counts a lock on node, of lock_type, which waited wait_ns nanoseconds if
+ * waited is set. Locks are counted by the height of their node rather than
+ * its depth, which lock_node is not told; nodes of the same height lie at
+ * about the same depth in a balanced tree, the root being the tallest, and
+ * heads, which have no height, are counted at level 0. */
+static void profile_lock(stats_t *stats, node_t *node, int lock_type,
+                         int waited, unsigned long long wait_ns) {
+    int height = node->name[0] == '\0' ? 0 : node->height;
+    stats_lock_level_t *level;
+
+    if (height >= STATS_LOCK_LEVELS) height = STATS_LOCK_LEVELS - 1;
+    level = &stats->lock_levels[lock_type != 0][height];
+    STATS_ADD(level->locks, 1);
+    if (waited) {
+        STATS_ADD(level->waits, 1);
+        STATS_ADD(level->wait_ns, wait_ns);
+    }
+    if (num_held < PROFILE_HELD) {
+        held_locks[num_held].node = node;
+        held_locks[num_held].level = level;
+        held_locks[num_held++].start = stats_now_ns();
+    }
+}
+
+// Releases a lock taken with lock_node, counting how long it was held
+static void unlock_node(node_t *node) {
+    int i = num_held - 1;
+
+    // Locks are mostly released in about the reverse order they were taken
+    while (i >= 0 && held_locks[i].node != node) i--;
+    if (i >= 0) {
+        STATS_ADD(held_locks[i].level->holds, 1);
+        STATS_ADD(held_locks[i].level->hold_ns,
+                  stats_now_ns() - held_locks[i].start);
+        held_locks[i] = held_locks[--num_held];
+    }
+    pthread_rwlock_unlock(&node->lock);
+}
+#else
+// Releases a lock taken with lock_node
+static inline void unlock_node(node_t *node) {
+    pthread_rwlock_unlock(&node->lock);
+}
+#endif
 
 // This method creates a read or write lock on a node,
-// give a lock_type
+// give a lock_type. A lock that cannot be taken straight away is waited
+// for, and the wait is counted in the calling thread's statistics.
 
 void lock_node(node_t *node, int lock_type) {
+    stats_t *stats = stats_local();
+    unsigned long long start = 0;
+    unsigned long long wait_ns = 0;
+    int waited = 0;
+
+    STATS_ADD(stats->locks, 1);
     if (lock_type == 0) {
-        pthread_rwlock_rdlock(&node->lock);
+        if (pthread_rwlock_tryrdlock(&node->lock) != 0) {
+            start = stats_now_ns();
+            pthread_rwlock_rdlock(&node->lock);
+            waited = 1;
+        }
     } else {
-        pthread_rwlock_wrlock(&node->lock);
+        if (pthread_rwlock_trywrlock(&node->lock) != 0) {
+            start = stats_now_ns();
+            pthread_rwlock_wrlock(&node->lock);
+            waited = 1;
+        }
     }
+    if (waited) {
+        wait_ns = stats_now_ns() - start;
+        STATS_ADD(stats->lock_waits, 1);
+        STATS_ADD(stats->lock_wait_ns, wait_ns);
+    }
+#ifdef LOCK_PROFILE
+    profile_lock(stats, node, lock_type, waited, wait_ns);
+#endif
 }
 
-node_t *node_constructor(char *arg_name, char *arg_value, node_t *arg_left,
-                         node_t *arg_right) {
-    size_t name_len = strlen(arg_name);
-    size_t val_len = strlen(arg_value);
+static inline int height(node_t *node) {
+    return node == NULL ? 0 : node->height;
+}
 
-    if (name_len > MAXLEN || val_len > MAXLEN) return 0;
+static inline void fix_height(node_t *node) {
+    int lheight = height(node->lchild);
+    int rheight = height(node->rchild);
 
-    node_t *new_node = (node_t *)malloc(sizeof(node_t));
+    node->height = (lheight > rheight ? lheight : rheight) + 1;
+}
 
-    if (new_node == 0) return 0;
+// Points whichever child pointer of parent refers to old_child at new_child
+static inline void replace_child(node_t *parent, node_t *old_child,
+                                 node_t *new_child) {
+    if (parent->lchild == old_child) {
+        store_child(parent->lchild, new_child);
+    } else {
+        store_child(parent->rchild, new_child);
+    }
+}
 
-    if ((new_node->name = (char *)malloc(name_len + 1)) == 0) {
-        free(new_node);
-        return 0;
+// Marks a write locked node as changing, so that lock-free readers wait for
+// the change to end before going through it
+static inline void begin_change(node_t *node) {
+    __atomic_store_n(&node->version, node->version | VERSION_CHANGING,
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// Ends a change, giving the node a new version. flags is VERSION_UNLINKED if
+// the change removed the node from the tree, 0 otherwise.
+static inline void end_change(node_t *node, unsigned long flags) {
+    unsigned long version = node->version & ~VERSION_CHANGING;
+
+    __atomic_store_n(&node->version, (version + VERSION_INCREMENT) | flags,
+                     __ATOMIC_RELEASE);
+}
+
+static void path_push(path_t *path, node_t *node) {
+    assert(path->len < MAX_HEIGHT + 2);
+    path->nodes[path->len++] = node;
+}
+
+// Unlocks every node above index i, making the node at i the top of the path
+static void path_release_above(path_t *path, int i) {
+    for (int j = 0; j < i; j++) {
+        unlock_node(path->nodes[j]);
+    }
+    memmove(path->nodes, &path->nodes[i], (path->len - i) * sizeof(node_t *));
+    path->len -= i;
+}
+
+static void path_release(path_t *path) {
+    path_release_above(path, path->len);
+}
+
+static int path_holds(path_t *path, node_t *node) {
+    for (int i = 0; i < path->len; i++) {
+        if (path->nodes[i] == node) return 1;
     }
+    return 0;
+}
 
-    if ((new_node->value = (char *)malloc(val_len + 1)) == 0) {
-        free(new_node->name);
-        free(new_node);
-        return 0;
+// Write locks a node taking part in a rotation unless the path already holds
+// it. Returns 1 if a lock was taken and must be released by the caller.
+static int lock_for_rotation(path_t *path, node_t *node) {
+    if (path_holds(path, node)) return 0;
+    lock_node(node, 1);
+    return 1;
+}
+
+// Rotates the subtree rooted at node (a child of parent) to the right. node
+// loses its left child's subtree, so it stays marked as changing until its
+// parent points at the new subtree root: a reader coming from the parent must
+// not find it with its new version while still expecting the old subtree.
+static void rotate_right(node_t *parent, node_t *node) {
+    node_t *left = node->lchild;
+
+    begin_change(node);
+    store_child(node->lchild, left->rchild);
+    store_child(left->rchild, node);
+    replace_child(parent, node, left);
+    end_change(node, 0);
+    fix_height(node);
+    fix_height(left);
+}
+
+// Rotates the subtree rooted at node (a child of parent) to the left
+static void rotate_left(node_t *parent, node_t *node) {
+    node_t *right = node->rchild;
+
+    begin_change(node);
+    store_child(node->rchild, right->lchild);
+    store_child(right->lchild, node);
+    replace_child(parent, node, right);
+    end_change(node, 0);
+    fix_height(node);
+    fix_height(right);
+}
+
+/* Recomputes the height of the node at index i of the path and, if the
+ * heights of its subtrees differ by more than one, rotates it back into
+ * balance, pointing its parent (the node at index i - 1) at the new subtree
+ * root. After a removal, the taller subtree being rotated up is not on the
+ * path, so its nodes are locked for the duration of the rotation. */
+static void rebalance(path_t *path, int i) {
+    node_t *node = path->nodes[i];
+    node_t *child, *grandchild;
+    int child_locked, grandchild_locked = 0;
+    int balance = height(node->lchild) - height(node->rchild);
+
+    if (balance >= -1 && balance <= 1) {
+        fix_height(node);
+        return;
     }
 
-    if ((snprintf(new_node->name, MAXLEN, "%s", arg_name)) < 0) {
-        free(new_node->value);
-        free(new_node->name);
-        free(new_node);
-        return 0;
-    } else if ((snprintf(new_node->value, MAXLEN, "%s", arg_value)) < 0) {
-        free(new_node->value);
-        free(new_node->name);
-        free(new_node);
-        return 0;
+    if (balance > 1) {
+        child = node->lchild;
+        child_locked = lock_for_rotation(path, child);
+        if (height(child->lchild) < height(child->rchild)) {
+            grandchild = child->rchild;
+            grandchild_locked = lock_for_rotation(path, grandchild);
+            rotate_left(node, child);
+        }
+        rotate_right(path->nodes[i - 1], node);
+    } else {
+        child = node->rchild;
+        child_locked = lock_for_rotation(path, child);
+        if (height(child->rchild) < height(child->lchild)) {
+            grandchild = child->lchild;
+            grandchild_locked = lock_for_rotation(path, grandchild);
+            rotate_right(node, child);
+        }
+        rotate_left(path->nodes[i - 1], node);
+    }
+
+    if (grandchild_locked) unlock_node(grandchild);
+    if (child_locked) unlock_node(child);
+}
+
+// Rebalances the path bottom-up, then releases it. The top of the path is
+// either the head or a safe node, so it never needs rebalancing itself.
+static void path_rebalance(path_t *path) {
+    for (int i = path->len - 1; i > 0; i--) {
+        rebalance(path, i);
+    }
+    path_release(path);
+}
+
+// Whether the height of node is certain not to change when key is added to
+// (remove == 0) or removed from (remove == 1) its subtree. An insertion is
+// safe if it goes down the shorter subtree, which can grow by one without
+// changing the node's height or unbalancing it. A removal is safe if both
+// subtrees have the same height, as either of them can shrink by one.
+static int is_safe(node_t *node, db_key_t *key, int remove) {
+    if (remove) {
+        return height(node->lchild) == height(node->rchild);
+    } else if (key_compare(key, node) < 0) {
+        return height(node->lchild) < height(node->rchild);
+    } else {
+        return height(node->rchild) < height(node->lchild);
+    }
+}
+
+/* Descends from a head with hand-over-hand read locks, holding on to the
+ * deepest node that is safe for the operation (the anchor) and to its parent,
+ * then write locks the anchor and makes it the top of the (empty) path. The
+ * parent's read lock keeps the anchor in place while it is upgraded; if the
+ * anchor turned out to be no longer safe once write locked, the descent is
+ * retried, and after MAX_ANCHOR_RETRIES the head is write locked instead.
+ *
+ * Returns 0, leaving nothing locked, if the descent already shows that the
+ * operation cannot succeed: key is in the tree when adding (remove == 0), or
+ * absent when removing (remove == 1). Returns 1 otherwise. */
+static int lock_anchor(node_t *head, db_key_t *key, int remove,
+                       path_t *path) {
+    node_t *above;
+    node_t *anchor;
+    node_t *node;
+    node_t *next;
+    int found;
+
+    for (int attempt = 0; attempt < MAX_ANCHOR_RETRIES; attempt++) {
+        above = 0;
+        anchor = head;
+        node = head;
+        found = 0;
+
+        lock_node(head, 0);
+        while (1) {
+            next = key_compare(key, node) < 0 ? node->lchild : node->rchild;
+            if (next == 0) break;
+
+            lock_node(next, 0);
+            if (key_compare(key, next) == 0) {
+                found = 1;
+                break;
+            }
+
+            // Moving the anchor down, or just the hand-over-hand lock
+            if (is_safe(next, key, remove)) {
+                if (above != 0) unlock_node(above);
+                if (anchor != node) unlock_node(anchor);
+                above = node;
+                anchor = next;
+            } else if (node != anchor) {
+                unlock_node(node);
+            }
+            node = next;
+        }
+
+        if (found) unlock_node(next);
+        if (node != anchor) unlock_node(node);
+        unlock_node(anchor);
+
+        if (found != remove) {
+            if (above != 0) unlock_node(above);
+            return (0);
+        }
+
+        // The head is never moved nor unbalanced, so it needs no checking
+        lock_node(anchor, 1);
+        if (above == 0) {
+            path_push(path, anchor);
+            return (1);
+        }
+
+        unlock_node(above);
+        if (is_safe(anchor, key, remove)) {
+            path_push(path, anchor);
+            return (1);
+        }
+        unlock_node(anchor);
     }
 
+    lock_node(head, 1);
+    path_push(path, head);
+    return (1);
+}
+
+/* Allocates a node holding key and value from the slab allocator, with both
+ * strings stored inline after the node itself so that a node is a single
+ * allocation. Returns 0 if either string is too long or memory runs out. */
+node_t *node_constructor(db_key_t *key, char *arg_value, node_t *arg_left,
+                         node_t *arg_right) {
+    size_t val_len = strlen(arg_value);
+    node_t *new_node;
+
+    if (key->len > MAXLEN || val_len > MAXLEN) return 0;
+
+    new_node = (node_t *)slab_alloc(NODE_SIZE(key->len, val_len));
+    if (new_node == 0) return 0;
+
+    new_node->name = new_node->data;
+    new_node->value = new_node->data + key->len + 1;
+    memcpy(new_node->name, key->name, key->len + 1);
+    memcpy(new_node->value, arg_value, val_len + 1);
+    new_node->name_len = key->len;
+    new_node->value_len = val_len;
+    new_node->prefix = key->prefix;
+
     pthread_rwlock_init(&new_node->lock, 0);
     new_node->lchild = arg_left;
     new_node->rchild = arg_right;
+    fix_height(new_node);
+    new_node->version = 0;
     return new_node;
 }
 
 void node_destructor(node_t *node) {
-    if (node->name != 0) free(node->name);
-    if (node->value != 0) free(node->value);
     pthread_rwlock_destroy(&node->lock);
-    free(node);
+    slab_free(node, NODE_SIZE(node->name_len, node->value_len));
+}
+
+// Frees a node retired through the epoch module
+static void node_free(void *node) { node_destructor((node_t *)node); }
+
+/* Searches the tree for key without taking any locks. Returns the node
+ * holding key, with the version it had when it was reached in *versionp, or
+ * 0 if it is not in the tree. The caller must be inside an epoch, which
+ * keeps the node from being freed while it is being read.
+ *
+ * Every step down the tree reads the child's version, then checks that the
+ * parent still points at the child and that the parent's version has not
+ * changed since the parent itself was reached: at that moment the child was
+ * in the tree and its subtree was where key would be. Returns head (which
+ * is never a search result) if a concurrent change got in the way and the
+ * search has to be restarted. */
+static node_t *search_optimistic(node_t *head, db_key_t *key,
+                                 unsigned long *versionp) {
+    node_t *node = head;
+    node_t *next;
+    unsigned long version = __atomic_load_n(&head->version, __ATOMIC_ACQUIRE);
+    unsigned long next_version;
+
+    while (1) {
+        node_t **slot =
+            key_compare(key, node) < 0 ? &node->lchild : &node->rchild;
+
+        next = load_child(*slot);
+        if (next == 0) {
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&node->version, __ATOMIC_RELAXED) != version) {
+                return head;
+            }
+            return 0;
+        }
+
+        next_version = __atomic_load_n(&next->version, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ((next_version & (VERSION_CHANGING | VERSION_UNLINKED)) ||
+            load_child(*slot) != next ||
+            __atomic_load_n(&node->version, __ATOMIC_RELAXED) != version) {
+            return head;
+        }
+
+        node = next;
+        version = next_version;
+        if (key_compare(key, node) == 0) {
+            *versionp = version;
+            return node;
+        }
+    }
 }
 
 // A locktype of 0 indicates a read lock, while a locktype of
 // 1 indicates a write lock
-node_t *search(char *, node_t *, node_t **, int lock_type);
+node_t *search(db_key_t *, node_t *, node_t **, int lock_type);
 
-void db_query(char *name, char *result, int len) {
-    // TODO: Make this thread-safe!
+// Returns the head of the shard that name belongs to (FNV-1a hash)
+static node_t *shard_of(char *name) {
+    unsigned int hash = 2166136261u;
+
+    if (num_shards == 1) return heads;
+
+    for (unsigned char *c = (unsigned char *)name; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return &heads[hash % num_shards];
+}
+
+/* Splits the database into num shards, each an independent tree with its own
+ * head and locks, with keys assigned to shards by hash. Must be called before
+ * the database is first used. Returns 0 on success, or -1 if num is out of
+ * range or the shards could not be allocated. */
+int db_init(int num) {
+    node_t *new_heads;
+
+    if (num < 1 || num > MAX_SHARDS) return -1;
+    if (num == 1) return 0;
+
+    if ((new_heads = calloc(num, sizeof(node_t))) == 0) return -1;
+    for (int i = 0; i < num; i++) {
+        new_heads[i].name = "";
+        new_heads[i].value = "";
+        pthread_rwlock_init(&new_heads[i].lock, 0);
+    }
+
+    heads = new_heads;
+    num_shards = num;
+    return 0;
+}
+
+/* Puts a cache of about bytes in front of the tree for queries (see
+ * cache.h), which holds the most popular keys whose key and value together
+ * take no more than CACHE_DATA bytes. Must be called before the database is
+ * first used. Returns 0 on success, or -1 if memory runs out. */
+int db_cache(size_t bytes) {
+    return cache_init(bytes);
+}
+
+// Copies up to len-1 bytes of node's value to result, NUL terminated, and
+// returns how many were copied
+static int copy_value(node_t *node, char *result, int len) {
+    int n = node->value_len < len - 1 ? node->value_len : len - 1;
+
+    memcpy(result, node->value, n);
+    result[n] = '\0';
+    return n;
+}
+
+/* Copies the value of key into result like copy_value, if the mapped
+ * snapshot holds key and it has not been copied into the tree. Returns the
+ * length of the value, or -1 if the tree is the place to look. */
+static int mapped_value(db_key_t *key, char *result, int len) {
+    mapped_record_t record;
+    long index;
+    int n;
+
+    if ((index = mapped_find(key->name, key->len)) < 0 ||
+        mapped_shadowed(index) || mapped_get(index, &record) < 0) {
+        return -1;
+    }
+
+    n = (int)record.value_len < len - 1 ? (int)record.value_len : len - 1;
+    memcpy(result, record.value, n);
+    result[n] = '\0';
+    return n;
+}
+
+/* Does the work of db_lookup, from the tree or the mapped snapshot. */
+static int lookup(db_key_t *key, char *result, int len) {
+    node_t *head = shard_of(key->name);
     node_t *target;
     node_t *parent;
+    unsigned long version;
+    int n;
+
+    if ((n = mapped_value(key, result, len)) >= 0) return n;
+
+    // Looking the node up without taking any locks, unless concurrent
+    // writers keep getting in the way. The value may be updated while it
+    // is copied, in which case the node's version changes.
+    epoch_enter();
+    for (int attempt = 0; attempt < MAX_OPTIMISTIC_RETRIES; attempt++) {
+        if ((target = search_optimistic(head, key, &version)) == head) {
+            continue;
+        }
+        if (target == 0) {
+            epoch_exit();
+            return -1;
+        }
+
+        n = copy_value(target, result, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&target->version, __ATOMIC_RELAXED) != version) {
+            continue;
+        }
+        epoch_exit();
+        return n;
+    }
+    epoch_exit();
 
     // Locking the head node and calling search
-    lock_node(&head, 0);
-    target = search(name, &head, &parent, 0);
+    lock_node(head, 0);
+    target = search(key, head, &parent, 0);
 
     // Target was not found, the parent is locked so we must unlock it
     if (target == 0) {
-        snprintf(result, len, "not found");
-        pthread_rwlock_unlock(&parent->lock);
-        return;
+        unlock_node(parent);
+        return -1;
 
         // Target was found, parent and target are locked so both must be
         // unlocked
     } else {
-        snprintf(result, len, "%s", target->value);
-        pthread_rwlock_unlock(&target->lock);
-        pthread_rwlock_unlock(&parent->lock);
-        return;
+        n = copy_value(target, result, len);
+        unlock_node(target);
+        unlock_node(parent);
+        return n;
     }
 }
 
-int db_add(char *name, char *value) {
+/* Looks name up, writing up to len-1 bytes of its value to result. Returns
+ * the length of what was written, or -1 if name was not found. Popular keys
+ * are answered from the cache, if there is one (see db_cache). */
+int db_lookup(char *name, char *result, int len) {
+    stats_t *stats;
+    unsigned long generation;
+    db_key_t key;
+    int n;
+
+    key_init(&key, name);
+    if (!cache_enabled()) return lookup(&key, result, len);
+
+    stats = stats_local();
+    if ((n = cache_get(name, key.len, result, len, &generation)) >= 0) {
+        STATS_ADD(stats->cache_hits, 1);
+        return n;
+    }
+    STATS_ADD(stats->cache_misses, 1);
+
+    // A value that filled result may have been cut short
+    if ((n = lookup(&key, result, len)) >= 0 && n < len - 1) {
+        cache_put(name, key.len, result, n, generation);
+    }
+    return n;
+}
+
+void db_query(char *name, char *result, int len) {
     // TODO: Make this thread-safe! DONE
+    if (db_lookup(name, result, len) < 0) snprintf(result, len, "not found");
+}
 
-    node_t *parent;
-    node_t *target;
+// What add_node did
+#define ADD_EXISTS 0
+#define ADD_DONE 1
+#define ADD_NO_MEMORY 2
+
+/* Does the work of db_add. If shadow is not negative, key is instead record
+ * shadow of the mapped snapshot being copied into the tree (see
+ * materialize), which is only done if no one else copied it first, and is
+ * otherwise reported as ADD_EXISTS. ADD_NO_MEMORY also covers a key or value
+ * that is too long. */
+static int add_node(db_key_t *key, char *value, long shadow) {
+    path_t path = {.len = 0};
+    node_t *node;
+    node_t *next;
     node_t *newnode;
 
-    // Locking the head and calling search
-    lock_node(&head, 1);
+    // Write locking the anchor and walking down to the new node's parent,
+    // keeping every node whose height may change locked
+    if (!lock_anchor(shard_of(key->name), key, 0, &path)) return ADD_EXISTS;
+
+    while (1) {
+        node = path.nodes[path.len - 1];
+        next = key_compare(key, node) < 0 ? node->lchild : node->rchild;
+        if (next == 0) break;
+
+        lock_node(next, 1);
 
-    // Target was already in the database, unlocking both and then
-    // returning
-    if ((target = search(name, &head, &parent, 1)) != 0) {
-        pthread_rwlock_unlock(&target->lock);
-        pthread_rwlock_unlock(&parent->lock);
-        return (0);
+        // Target was already in the database, unlocking everything and
+        // then returning
+        if (key_compare(key, next) == 0) {
+            unlock_node(next);
+            path_release(&path);
+            return ADD_EXISTS;
+        }
+
+        path_push(&path, next);
+        if (is_safe(next, key, 0)) {
+            path_release_above(&path, path.len - 1);
+        }
     }
 
-    newnode = node_constructor(name, value, 0, 0);
+    // A copy that was removed since must not come back
+    if (shadow >= 0 && mapped_shadowed(shadow)) {
+        path_release(&path);
+        return ADD_EXISTS;
+    }
+    if ((newnode = node_constructor(key, value, 0, 0)) == 0) {
+        path_release(&path);
+        return ADD_NO_MEMORY;
+    }
 
-    // Target was not in the database. Adding the new node
-    // then unlocking the parent, then returning
-    if (strcmp(name, parent->name) < 0)
-        parent->lchild = newnode;
+    // Target was not in the database. Adding the new node (locked, so that
+    // it is part of the path like its ancestors), then rebalancing
+    lock_node(newnode, 1);
+    if (key_compare(key, node) < 0)
+        store_child(node->lchild, newnode);
     else
-        parent->rchild = newnode;
+        store_child(node->rchild, newnode);
+    path_push(&path, newnode);
+
+    // Logged while the new node is locked, so before any later change to
+    // it. A copy from the snapshot changes nothing, and is not logged.
+    // Neither needs invalidating in the cache, which only holds keys that
+    // were found.
+    if (shadow >= 0) {
+        mapped_shadow(shadow);
+    } else {
+        wal_append(WAL_ADD, key->name, key->len, newnode->value,
+                   newnode->value_len);
+        STATS_ADD(stats_local()->keys, 1);
+    }
 
-    pthread_rwlock_unlock(&parent->lock);
-    return (1);
+    path_rebalance(&path);
+    return ADD_DONE;
+}
+
+/* Copies key into the tree if the mapped snapshot holds it and it has not
+ * been copied yet, so that it can be written there. Readers go on reading
+ * it from the snapshot until the copy is linked and the key marked as
+ * shadowed, and from the tree from then on. */
+static void materialize(db_key_t *key) {
+    mapped_record_t record;
+    char value[MAXLEN + 1];
+    size_t len;
+    long index;
+
+    if ((index = mapped_find(key->name, key->len)) < 0 ||
+        mapped_shadowed(index) || mapped_get(index, &record) < 0) {
+        return;
+    }
+
+    len = record.value_len < MAXLEN ? record.value_len : MAXLEN;
+    memcpy(value, record.value, len);
+    value[len] = '\0';
+    add_node(key, value, index);
+}
+
+int db_add(char *name, char *value) {
+    // TODO: Make this thread-safe! DONE
+    db_key_t key;
+
+    key_init(&key, name);
+    materialize(&key);
+    return add_node(&key, value, -1) == ADD_DONE;
 }
 
 int db_remove(char *name) {
-    // TODO: Make this thread-safe!
+    // TODO: Make this thread-safe! DONE
 
-    node_t *parent;
+    path_t path = {.len = 0};
+    node_t *node;
     node_t *dnode;
     node_t *next;
+    db_key_t key;
+
+    key_init(&key, name);
+    materialize(&key);
+
+    // Write locking the anchor and searching for the node below it, keeping
+    // every node whose height may change locked
+    if (!lock_anchor(shard_of(name), &key, 1, &path)) return (0);
 
-    // Locking the head and searching for the node
-    lock_node(&head, 1);
     // first, find the node to be removed
-    if ((dnode = search(name, &head, &parent, 1)) == 0) {
-        // it's not there
-        pthread_rwlock_unlock(&parent->lock);
-        return (0);
-    }
+    while (1) {
+        node = path.nodes[path.len - 1];
+        dnode = key_compare(&key, node) < 0 ? node->lchild : node->rchild;
+        if (dnode == 0) {
+            // it's not there
+            path_release(&path);
+            return (0);
+        }
 
-    // dnode is currently locked, parent is currently locked
+        lock_node(dnode, 1);
+        path_push(&path, dnode);
+        if (key_compare(&key, dnode) == 0) break;
+        if (is_safe(dnode, &key, 1)) {
+            path_release_above(&path, path.len - 1);
+        }
+    }
 
-    // We found it, if the node has no right child, then we can merely replace
-    // its parent's pointer to it with the node's left child.
+    // dnode is currently locked, as is its parent just above it on the path
+    wal_append(WAL_REMOVE, key.name, key.len, "", 0);
 
-    if (dnode->rchild == 0) {
-        if (strcmp(dnode->name, parent->name) < 0)
-            parent->lchild = dnode->lchild;
-        else
-            parent->rchild = dnode->lchild;
+    // We found it, if the node has at most one child, then we can merely
+    // replace its parent's pointer to it with that child.
 
-        // done with dnode
-        pthread_rwlock_unlock(&dnode->lock);
-        node_destructor(dnode);
-        pthread_rwlock_unlock(&parent->lock);
-    } else if (dnode->lchild == 0) {
-        // ditto if the node had no left child
-        if (strcmp(dnode->name, parent->name) < 0)
-            parent->lchild = dnode->rchild;
-        else
-            parent->rchild = dnode->rchild;
+    if (dnode->rchild == 0 || dnode->lchild == 0) {
+        begin_change(dnode);
+        replace_child(path.nodes[path.len - 2], dnode,
+                      dnode->lchild != 0 ? dnode->lchild : dnode->rchild);
+        end_change(dnode, VERSION_UNLINKED);
 
         // done with dnode
-        pthread_rwlock_unlock(&dnode->lock);
-        node_destructor(dnode);
-        pthread_rwlock_unlock(&parent->lock);
+        path.len--;
+        unlock_node(dnode);
+        epoch_retire(dnode, node_free);
     } else {
         // Find the lexicographically smallest node in the right subtree and
         // replace the node to be deleted with that node. This new node thus is
         // lexicographically smaller than all nodes in its right subtree, and
         // greater than all nodes in its left subtree
 
-        lock_node(dnode->rchild, 1);
+        int dindex = path.len - 1;
+
         next = dnode->rchild;
-        node_t **pnext = &dnode->rchild;
+        lock_node(next, 1);
+        path_push(&path, next);
 
         while (next->lchild != 0) {
             // work our way down the lchild chain, finding the smallest node
-            // in the subtree.
-            node_t *nextl = next->lchild;
-            pnext = &next->lchild;
+            // in the subtree. Every node on the way may shrink, so all of
+            // them stay locked.
+            next = next->lchild;
+            lock_node(next, 1);
+            path_push(&path, next);
+        }
+
+        // Every node between dnode and next loses next from its subtree
+        for (int i = dindex; i < path.len; i++) {
+            begin_change(path.nodes[i]);
+        }
+
+        // Setting the child node of parent to be the right child of next
+        // node, then moving next into dnode's place (and onto the path in
+        // its stead), so that keys never change under a reader
+        replace_child(path.nodes[path.len - 2], next, next->rchild);
+        path.len--;
+        store_child(next->lchild, dnode->lchild);
+        store_child(next->rchild, dnode->rchild);
+        next->height = dnode->height;
+        replace_child(path.nodes[dindex - 1], dnode, next);
+
+        end_change(dnode, VERSION_UNLINKED);
+        for (int i = dindex + 1; i <= path.len; i++) {
+            end_change(path.nodes[i], 0);
+        }
+        path.nodes[dindex] = next;
+
+        unlock_node(dnode);
+        epoch_retire(dnode, node_free);
+    }
+    cache_invalidate(key.name, key.len);
+    STATS_ADD(stats_local()->keys, -1);
+
+    path_rebalance(&path);
+    return (1);
+}
 
-            // Locking the left child of the given node
-            lock_node(nextl, 1);
+// What update_value found
+#define UPDATE_ABSENT 0
+#define UPDATE_DONE 1
+#define UPDATE_RETRY 2
+#define UPDATE_NO_MEMORY 3
+
+/* Does the work of db_update for one attempt. Descends with hand-over-hand
+ * read locks, holding on to the grandparent of the next node as well. A node
+ * cannot be unlinked or rotated while its parent is locked, so the key of the
+ * next node can be checked before locking it, and the node holding key is
+ * then write locked straight away.
+ *
+ * A value that fits in the node's slab size class is changed in place, with
+ * nothing but the node write locked. Otherwise the node is replaced by a new
+ * one, which needs its parent write locked: the parent's read lock is traded
+ * for a write lock while the grandparent keeps it in place, but the node may
+ * have been moved meanwhile, in which case UPDATE_RETRY is returned. */
+static int update_value(node_t *head, db_key_t *key, char *value) {
+    size_t len = strlen(value);
+    node_t *above = 0;
+    node_t *parent = head;
+    node_t *target;
+    node_t *newnode;
 
-            // Unlocking the parent node
-            pthread_rwlock_unlock(&next->lock);
-            next = nextl;
+    lock_node(head, 0);
+    while (1) {
+        target = key_compare(key, parent) < 0 ? parent->lchild : parent->rchild;
+        if (target == 0) {
+            unlock_node(parent);
+            if (above != 0) unlock_node(above);
+            return UPDATE_ABSENT;
         }
+        if (key_compare(key, target) == 0) break;
+
+        lock_node(target, 0);
+        if (above != 0) unlock_node(above);
+        above = parent;
+        parent = target;
+    }
+
+    lock_node(target, 1);
+    if (slab_resize(target, NODE_SIZE(target->name_len, target->value_len),
+                    NODE_SIZE(target->name_len, len))) {
+        unlock_node(parent);
+        if (above != 0) unlock_node(above);
+
+        wal_append(WAL_SET, key->name, key->len, value, len);
+        begin_change(target);
+        memcpy(target->value, value, len + 1);
+        target->value_len = len;
+        end_change(target, 0);
+        cache_invalidate(key->name, key->len);
+
+        unlock_node(target);
+        return UPDATE_DONE;
+    }
+    unlock_node(target);
+
+    // The head is never moved, so it needs no grandparent
+    unlock_node(parent);
+    lock_node(parent, 1);
+    if (above != 0) unlock_node(above);
+
+    target = key_compare(key, parent) < 0 ? parent->lchild : parent->rchild;
+    if (target == 0 || key_compare(key, target) != 0) {
+        unlock_node(parent);
+        return UPDATE_RETRY;
+    }
+    lock_node(target, 1);
+
+    // The new node takes the old one's place, children and height
+    if ((newnode = node_constructor(key, value, target->lchild,
+                                    target->rchild)) == 0) {
+        unlock_node(target);
+        unlock_node(parent);
+        return UPDATE_NO_MEMORY;
+    }
+    wal_append(WAL_SET, key->name, key->len, value, len);
+    begin_change(target);
+    replace_child(parent, target, newnode);
+    end_change(target, VERSION_UNLINKED);
+    cache_invalidate(key->name, key->len);
+
+    unlock_node(target);
+    unlock_node(parent);
+    epoch_retire(target, node_free);
+    return UPDATE_DONE;
+}
 
-        // Moving the information from next node into dnode
-        dnode->name = realloc(dnode->name, strlen(next->name) + 1);
-        dnode->value = realloc(dnode->value, strlen(next->value) + 1);
-        snprintf(dnode->name, MAXLEN, "%s", next->name);
-        snprintf(dnode->value, MAXLEN, "%s", next->value);
+/* Replaces the value of name, if it is in the database, returning 1 if so
+ * and 0 otherwise (or if value is too long or memory runs out). Only the
+ * node holding name is write locked, unless the new value does not fit in
+ * it, in which case its parent is too while the node is swapped for a
+ * bigger (or smaller) one. */
+int db_update(char *name, char *value) {
+    db_key_t key;
+    int ret;
 
-        // Setting the child node of parent to be the right child of next node
-        *pnext = next->rchild;
-        pthread_rwlock_unlock(&next->lock);
+    key_init(&key, name);
+    if (key.len > MAXLEN || strlen(value) > MAXLEN) return 0;
+    materialize(&key);
 
-        node_destructor(next);
-        pthread_rwlock_unlock(&dnode->lock);
-        pthread_rwlock_unlock(&parent->lock);
+    while ((ret = update_value(shard_of(name), &key, value)) == UPDATE_RETRY) {
     }
+    return ret == UPDATE_DONE;
+}
 
-    return (1);
+/* Sets the value of name, adding it if it is not in the database yet.
+ * Returns 1 if name was updated, 2 if it was added, and 0 if value is too
+ * long or memory runs out. */
+int db_upsert(char *name, char *value) {
+    db_key_t key;
+    int ret;
+
+    key_init(&key, name);
+    if (key.len > MAXLEN || strlen(value) > MAXLEN) return 0;
+    materialize(&key);
+
+    // Short of memory running out, whichever of updating and adding fails
+    // can only do so because another writer added or removed name in the
+    // meantime
+    while (1) {
+        ret = update_value(shard_of(name), &key, value);
+        if (ret == UPDATE_DONE) return 1;
+        if (ret == UPDATE_NO_MEMORY) return 0;
+        if (ret == UPDATE_ABSENT) {
+            ret = add_node(&key, value, -1);
+            if (ret == ADD_DONE) return 2;
+            if (ret == ADD_NO_MEMORY) return 0;
+        }
+    }
 }
 
-node_t *search(char *name, node_t *parent, node_t **parentpp, int lock_type) {
+node_t *search(db_key_t *key, node_t *parent, node_t **parentpp,
+               int lock_type) {
     // Search the tree, starting at parent, for a node containing
-    // name (the "target node").  Return a pointer to the node,
+    // key (the "target node").  Return a pointer to the node,
     // if found, otherwise return 0.  If parentpp is not 0, then it points
     // to a location at which the address of the parent of the target node
     // is stored.  If the target node is not found, the location pointed to
@@ -227,35 +1085,32 @@ node_t *search(char *name, node_t *parent, node_t **parentpp, int lock_type) {
     // TODO: Make this thread-safe! DONE
 
     node_t *next;
-    node_t *result;
-
-    // Setting next to left child if name is less than parent
-    if (strcmp(name, parent->name) < 0) {
-        next = parent->lchild;
-
-        // Setting next to right child otherwise
-    } else {
-        next = parent->rchild;
-    }
+    node_t *result = NULL;
+
+    // Walking down hand-over-hand: a parent is only unlocked once its child
+    // is locked
+    while (1) {
+        // Setting next to left child if key is less than parent, to the
+        // right child otherwise
+        if (key_compare(key, parent) < 0) {
+            next = parent->lchild;
+        } else {
+            next = parent->rchild;
+        }
 
-    // Setting result to null if the next pointer is null
-    if (next == NULL) {
-        result = NULL;
+        // Leaving result null if the next pointer is null
+        if (next == NULL) break;
 
-    } else {
-        // Locking the child node
+        // Locking the child node. If the child is equal to the desired key,
+        // the result is set to the child, otherwise the search carries on
+        // with the child as the parent node
         lock_node(next, lock_type);
-        // If the child is equal to the desired key, the result is set to the
-        // child
-        if (strcmp(name, next->name) == 0) {
+        if (key_compare(key, next) == 0) {
             result = next;
-
-            // If it is not, search is called again with the child as the parent
-            // node
-        } else {
-            pthread_rwlock_unlock(&parent->lock);
-            return search(name, next, parentpp, lock_type);
+            break;
         }
+        unlock_node(parent);
+        parent = next;
     }
 
     // Setting the parent pointer to point to the parent node
@@ -266,193 +1121,1773 @@ node_t *search(char *name, node_t *parent, node_t **parentpp, int lock_type) {
     return result;
 }
 
-static inline void print_spaces(int lvl, FILE *out) {
-    for (int i = 0; i < lvl; i++) {
-        fprintf(out, " ");
+/*
+ * An in-order cursor over one shard. Its stack holds the nodes still to be
+ * visited whose left subtrees are being walked, the next node in order on
+ * top. Only those nodes are read locked, which is enough to keep the rest of
+ * the walk in place while writers go on changing the nodes already visited.
+ */
+typedef struct cursor {
+    node_t *stack[MAX_HEIGHT + 1];
+    int depth;
+} cursor_t;
+
+// Read locks and pushes node and its chain of left descendants. The node's
+// parent must be locked by the caller.
+static void cursor_push_left(cursor_t *cursor, node_t *node) {
+    while (node != 0) {
+        lock_node(node, 0);
+        assert(cursor->depth < MAX_HEIGHT + 1);
+        cursor->stack[cursor->depth++] = node;
+        node = node->lchild;
     }
 }
 
-/* Recursively traverses the database tree and prints nodes
- * pre-order. */
-void db_print_recurs(node_t *node, int lvl, FILE *out) {
-    // print spaces to differentiate levels
-    print_spaces(lvl, out);
-
-    // print out the current node
-    if (node == NULL) {
-        fprintf(out, "(null)\n");
-        return;
-    }
-
-    if (node == &head) {
-        fprintf(out, "(root)\n");
-    } else {
-        fprintf(out, "%s %s\n", node->name, node->value);
-    }
+// Returns the node the cursor is on, or 0 once it is past the last key
+static node_t *cursor_node(cursor_t *cursor) {
+    return cursor->depth > 0 ? cursor->stack[cursor->depth - 1] : 0;
+}
 
-    // The passed in node is always locked. We must lock its children,
-    // unlock it, and then call the recurse function. Once the recurs function
-    // returns, we must unlock the children.
-    if (node->lchild != NULL) {
-        lock_node(node->lchild, 0);
-    }
-    if (node->rchild != NULL) {
-        lock_node(node->rchild, 0);
-    }
+// Moves the cursor on to the next key, locking the right subtree of the
+// current node before letting go of it
+static void cursor_next(cursor_t *cursor) {
+    node_t *node = cursor->stack[--cursor->depth];
 
-    db_print_recurs(node->lchild, lvl + 1, out);
-    db_print_recurs(node->rchild, lvl + 1, out);
+    cursor_push_left(cursor, node->rchild);
+    unlock_node(node);
+}
 
-    if (node->lchild != NULL) {
-        pthread_rwlock_unlock(&node->lchild->lock);
-    }
-    if (node->rchild != NULL) {
-        pthread_rwlock_unlock(&node->rchild->lock);
+// Carries on a seek below node, whose child next is to be locked next. node
+// is locked, and on the stack unless held is set.
+static void cursor_descend(cursor_t *cursor, node_t *node, node_t *next,
+                           int held, db_key_t *key, int after) {
+    int cmp;
+
+    while (next != 0) {
+        lock_node(next, 0);
+        if (held) unlock_node(node);
+        node = next;
+
+        cmp = key_compare(key, node);
+        if (cmp < 0 || (cmp == 0 && !after)) {
+            assert(cursor->depth < MAX_HEIGHT + 1);
+            cursor->stack[cursor->depth++] = node;
+            held = 0;
+            // Nothing in the left subtree of a match is in range
+            if (cmp == 0) break;
+            next = node->lchild;
+        } else {
+            held = 1;
+            next = node->rchild;
+        }
     }
+    if (held) unlock_node(node);
 }
 
-/* Prints the whole database, using db_print_recurs, to a file with
- * the given filename, or to stdout if the filename is empty or NULL.
- * If the file does not exist, it is created. The file is truncated
- * in all cases.
- *
- * Returns 0 on success, or -1 if the file could not be opened
- * for writing. */
-int db_print(char *filename) {
-    FILE *out;
-
-    // Locking the head
-    lock_node(&head, 0);
+/* Positions the cursor on the smallest key of the shard that is not less
+ * than key (after == 0) or greater than key (after == 1), descending from
+ * head hand-over-hand. Every node on the way whose key is in range is pushed,
+ * as it is still to be visited; the others are let go of once their child
+ * is locked. */
+static void cursor_seek(cursor_t *cursor, node_t *head, db_key_t *key,
+                        int after) {
+    cursor->depth = 0;
+    lock_node(head, 0);
+    cursor_descend(cursor, head, head->rchild, 1, key, after);
+}
 
-    if (filename == NULL) {
-        db_print_recurs(&head, 0, stdout);
-        pthread_rwlock_unlock(&head.lock);
-        return 0;
-    }
-    // skip over leading whitespace
-    while (isspace(*filename)) {
-        filename++;
+/* Moves a cursor that was positioned by seeking a key not greater than key
+ * on to the smallest key not less than key, like cursor_seek but without
+ * starting over from head: the nodes on the stack whose keys are less than
+ * key are let go of, and the seek carries on from the last of them, in whose
+ * right subtree key belongs, or else from the node now on top, in whose left
+ * subtree it does. Those nodes stayed locked, so their subtrees still hold
+ * the same range of keys. */
+static void cursor_advance(cursor_t *cursor, node_t *head, db_key_t *key) {
+    node_t *from = 0;
+    node_t *top;
+
+    while (cursor->depth > 0 &&
+           key_compare(key, cursor->stack[cursor->depth - 1]) > 0) {
+        if (from != 0) unlock_node(from);
+        from = cursor->stack[--cursor->depth];
     }
 
-    if (*filename == '\0') {
-        db_print_recurs(&head, 0, stdout);
-        pthread_rwlock_unlock(&head.lock);
-        return 0;
+    if (from != 0) {
+        cursor_descend(cursor, from, from->rchild, 1, key, 0);
+    } else if (cursor->depth == 0) {
+        cursor_seek(cursor, head, key, 0);
+    } else {
+        top = cursor->stack[cursor->depth - 1];
+        if (key_compare(key, top) < 0) {
+            cursor_descend(cursor, top, top->lchild, 0, key, 0);
+        }
     }
+}
 
-    if ((out = fopen(filename, "w+")) == NULL) {
-        pthread_rwlock_unlock(&head.lock);
-        return -1;
+// Lets go of every node the cursor still holds
+static void cursor_close(cursor_t *cursor) {
+    while (cursor->depth > 0) {
+        unlock_node(cursor->stack[--cursor->depth]);
     }
+}
 
-    db_print_recurs(&head, 0, out);
-    fclose(out);
-    pthread_rwlock_unlock(&head.lock);
-    return 0;
+/*
+ * Dumps. A sorted dump is a range scan over every key, written out a batch
+ * at a time with nothing locked (see db_scan), so writers never wait for
+ * it, but it is not atomic.
+ *
+ * A tree dump lists the shape of each tree, which takes read locks instead.
+ * The top of each tree is locked by the dumping thread, and the subtrees
+ * below it are parts, each locked and formatted into a buffer of its own by
+ * whichever of the dump's threads takes it, and unlocked as soon as it is
+ * formatted. The top is unlocked once every part is locked, so that nothing
+ * can move from one part to another in between. Each part is then a
+ * consistent view of its subtree (a change holds write locks on everything
+ * it touches), but changes made while the dump runs may be seen by some
+ * parts and not by others. The buffers are written out in order once every
+ * part is formatted, with nothing locked any more.
+ */
+
+// Subtrees no higher than this are formatted whole by one thread, by up to
+// DUMP_MAX_THREADS threads
+#define DUMP_PART_HEIGHT 14
+#define DUMP_MAX_THREADS 16
+
+// A part of a tree dump, formatted by one thread
+typedef struct dump_part {
+    node_t *node;  // NULL for an empty subtree
+    int depth;     // Of node, in its tree
+    int whole;     // Whether the subtree below node is in the part too
+    char *text;    // The formatted part, len bytes long
+    size_t len;
+} dump_part_t;
+
+typedef struct dump {
+    dump_part_t *parts;
+    size_t num_parts;
+    size_t capacity;
+    size_t next;     // The first part not taken yet by a thread
+    size_t locked;   // Parts locked, or formatted if they need no lock
+    int top_locked;  // Whether the dumping thread still holds the top
+    int failed;
+} dump_t;
+
+typedef struct dump_thread {
+    dump_t *dump;
+    int id;  // 0 for the dumping thread
+    pthread_t thread;
+} dump_thread_t;
+
+// Whether node, depth deep in its tree, is formatted along with its whole
+// subtree rather than locked by the dumping thread
+static inline int dump_whole(node_t *node, int depth) {
+    return node == NULL || (depth > 0 && node->height <= DUMP_PART_HEIGHT);
 }
 
-/* Recursively destroys node and all its children. */
-void db_cleanup_recurs(node_t *node) {
-    if (node == NULL) {
-        return;
+// Appends a part to the dump, returning 0 or -1 if memory runs out
+static int dump_add(dump_t *dump, node_t *node, int depth, int whole) {
+    dump_part_t *parts;
+    dump_part_t *part;
+
+    if (dump->num_parts == dump->capacity) {
+        dump->capacity = dump->capacity == 0 ? 64 : 2 * dump->capacity;
+        parts = realloc(dump->parts, dump->capacity * sizeof(dump_part_t));
+        if (parts == NULL) return -1;
+        dump->parts = parts;
     }
+    part = &dump->parts[dump->num_parts++];
+    part->node = node;
+    part->depth = depth;
+    part->whole = whole;
+    part->text = NULL;
+    part->len = 0;
+    return 0;
+}
 
-    db_cleanup_recurs(node->lchild);
-    db_cleanup_recurs(node->rchild);
+/*
+ * The walks below keep an explicit stack of the nodes they are below, each
+ * with how many of its children have been walked, rather than recursing, so
+ * that their stack use is bounded by MAX_HEIGHT whatever the tree's shape.
+ * The node on top of the stack is base + len - 1 deep in its tree, base
+ * being the depth the walk started from.
+ */
+typedef struct dump_stack {
+    struct {
+        node_t *node;
+        int visited;
+    } frames[MAX_HEIGHT + 1];
+    int len;
+} dump_stack_t;
+
+static void dump_push(dump_stack_t *stack, node_t *node) {
+    assert(stack->len < MAX_HEIGHT + 1);
+    stack->frames[stack->len].node = node;
+    stack->frames[stack->len++].visited = 0;
+}
 
-    node_destructor(node);
+// Takes node, depth deep, into the split of dump_split: as a part of its
+// own, or locked and pushed so that its subtrees get split in turn
+static int dump_split_node(dump_t *dump, dump_stack_t *stack, node_t *node,
+                           int depth) {
+    if (dump_whole(node, depth)) return dump_add(dump, node, depth, 1);
+    if (depth > 0) lock_node(node, 0);
+    dump_push(stack, node);
+    return dump_add(dump, node, depth, 0);
 }
 
-/* Destroys all nodes in the database other than the head.
- * No threads should be using the database when this is called. */
+/* Read locks the top of the tree below head, which is already locked,
+ * splitting the tree into parts in pre-order. Returns 0, or -1 if memory
+ * runs out, in which case the top may be only partly split, but is locked
+ * all the same. */
+static int dump_split(dump_t *dump, node_t *head) {
+    dump_stack_t stack = {.len = 0};
+    node_t *node;
+    int ret;
+
+    ret = dump_split_node(dump, &stack, head, 0);
+    while (stack.len > 0) {
+        node = stack.frames[stack.len - 1].node;
+        if (stack.frames[stack.len - 1].visited == 2) {
+            stack.len--;
+            continue;
+        }
+        node = stack.frames[stack.len - 1].visited++ == 0 ? node->lchild
+                                                           : node->rchild;
+        ret |= dump_split_node(dump, &stack, node, stack.len);
+    }
+    return ret;
+}
+
+// Unlocks what dump_split locked below head, which is still in the same
+// shape, each node once both of its subtrees are
+static void dump_unsplit(node_t *head) {
+    dump_stack_t stack = {.len = 0};
+    node_t *node;
+    node_t *next;
+
+    dump_push(&stack, head);
+    while (stack.len > 0) {
+        node = stack.frames[stack.len - 1].node;
+        if (stack.frames[stack.len - 1].visited == 2) {
+            if (stack.len > 1) unlock_node(node);
+            stack.len--;
+            continue;
+        }
+        next = stack.frames[stack.len - 1].visited++ == 0 ? node->lchild
+                                                           : node->rchild;
+        if (!dump_whole(next, stack.len)) dump_push(&stack, next);
+    }
+}
+
+// Formats node, depth deep in its tree, as a line of a tree dump
+static void dump_node(node_t *node, int depth, FILE *out) {
+    if (node == NULL) {
+        fprintf(out, "%*s(null)\n", depth, "");
+    } else if (depth == 0) {
+        fprintf(out, "(root)\n");
+    } else {
+        fprintf(out, "%*s%s %s\n", depth, "", node->name, node->value);
+    }
+}
+
+// Read locks and formats the subtree below node, which is depth deep in its
+// tree and already locked
+static void dump_subtree(node_t *node, int depth, FILE *out) {
+    dump_stack_t stack = {.len = 0};
+    node_t *next;
+
+    dump_node(node, depth, out);
+    dump_push(&stack, node);
+    while (stack.len > 0) {
+        node = stack.frames[stack.len - 1].node;
+        if (stack.frames[stack.len - 1].visited == 2) {
+            stack.len--;
+            continue;
+        }
+        next = stack.frames[stack.len - 1].visited++ == 0 ? node->lchild
+                                                           : node->rchild;
+        if (next != NULL) lock_node(next, 0);
+        dump_node(next, depth + stack.len, out);
+        if (next != NULL) dump_push(&stack, next);
+    }
+}
+
+// Unlocks what dump_subtree locked, each node once both of its subtrees are
+static void dump_unlock(node_t *node) {
+    dump_stack_t stack = {.len = 0};
+    node_t *next;
+
+    dump_push(&stack, node);
+    while (stack.len > 0) {
+        node = stack.frames[stack.len - 1].node;
+        if (stack.frames[stack.len - 1].visited == 2) {
+            unlock_node(node);
+            stack.len--;
+            continue;
+        }
+        next = stack.frames[stack.len - 1].visited++ == 0 ? node->lchild
+                                                           : node->rchild;
+        if (next != NULL) dump_push(&stack, next);
+    }
+}
+
+// Unlocks the top of every tree, if the dumping thread still holds it and
+// every part is locked, returning whether it is unlocked
+static int dump_release_top(dump_t *dump) {
+    if (dump->top_locked &&
+        __atomic_load_n(&dump->locked, __ATOMIC_ACQUIRE) == dump->num_parts) {
+        for (int i = 0; i < num_shards; i++) {
+            dump_unsplit(&heads[i]);
+            unlock_node(&heads[i]);
+        }
+        dump->top_locked = 0;
+    }
+    return !dump->top_locked;
+}
+
+/* Formats parts of the dump until there are none left, unlocking each part
+ * once it is formatted. The dumping thread also lets go of the top as soon
+ * as every part is locked. */
+static void *dump_work(void *arg) {
+    dump_thread_t *thread = (dump_thread_t *)arg;
+    dump_t *dump = thread->dump;
+    dump_part_t *part;
+    size_t i;
+    FILE *out;
+
+    while ((i = __atomic_fetch_add(&dump->next, 1, __ATOMIC_RELAXED)) <
+           dump->num_parts) {
+        part = &dump->parts[i];
+        if (part->whole && part->node != NULL) {
+            lock_node(part->node, 0);
+            __atomic_fetch_add(&dump->locked, 1, __ATOMIC_RELEASE);
+        }
+
+        if ((out = open_memstream(&part->text, &part->len)) == NULL) {
+            dump->failed = 1;
+        } else {
+            if (part->whole && part->node != NULL) {
+                dump_subtree(part->node, part->depth, out);
+            } else {
+                dump_node(part->node, part->depth, out);
+            }
+            if (fclose(out) != 0) dump->failed = 1;
+        }
+
+        if (part->whole && part->node != NULL) {
+            dump_unlock(part->node);
+        } else {
+            __atomic_fetch_add(&dump->locked, 1, __ATOMIC_RELEASE);
+        }
+        if (thread->id == 0) dump_release_top(dump);
+    }
+
+    // Every part is taken, and is locked as soon as it is
+    if (thread->id == 0) {
+        while (!dump_release_top(dump)) {
+        }
+    }
+    return NULL;
+}
+
+// Formats the parts of the dump with as many threads as are worth it
+static void dump_format(dump_t *dump) {
+    dump_thread_t threads[DUMP_MAX_THREADS];
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int error;
+
+    if (num_threads > DUMP_MAX_THREADS) num_threads = DUMP_MAX_THREADS;
+    if ((size_t)num_threads > dump->num_parts) num_threads = dump->num_parts;
+    if (num_threads < 1) num_threads = 1;
+
+    for (int i = 0; i < num_threads; i++) {
+        threads[i].dump = dump;
+        threads[i].id = i;
+        if (i > 0 && (error = pthread_create(&threads[i].thread, 0, dump_work,
+                                             &threads[i]))) {
+            errno = error;
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    dump_work(&threads[0]);
+    for (int i = 1; i < num_threads; i++) {
+        if ((error = pthread_join(threads[i].thread, NULL))) {
+            errno = error;
+            perror("pthread_join");
+            exit(1);
+        }
+    }
+}
+
+// Writes out a tree dump (see above), returning 0 or -1 if memory runs out
+static int dump_tree(FILE *out) {
+    dump_t dump;
+
+    memset(&dump, 0, sizeof(dump));
+    for (int i = 0; i < num_shards; i++) lock_node(&heads[i], 0);
+    for (int i = 0; i < num_shards; i++) {
+        if (dump_split(&dump, &heads[i]) < 0) dump.failed = 1;
+    }
+    dump.top_locked = 1;
+    dump_format(&dump);
+
+    for (size_t i = 0; i < dump.num_parts && !dump.failed; i++) {
+        fwrite(dump.parts[i].text, 1, dump.parts[i].len, out);
+    }
+    for (size_t i = 0; i < dump.num_parts; i++) free(dump.parts[i].text);
+    free(dump.parts);
+    return dump.failed ? -1 : 0;
+}
+
+// Writes a key and its value as a line of a sorted dump
+static void dump_emit(char *name, char *value, void *arg) {
+    FILE *out = (FILE *)arg;
+
+    fputs(name, out);
+    fputc(' ', out);
+    fputs(value, out);
+    fputc('\n', out);
+}
+
+/* Dumps the whole database to a file with the given filename, or to stdout
+ * if the filename is empty or NULL. If the file does not exist, it is
+ * created. The file is truncated in all cases. With DB_DUMP_TREE, each
+ * shard's tree is listed pre-order, a node per line indented by its depth,
+ * under a (root) line for its head; keys still only in a mapped snapshot
+ * are in no tree, and are left out. With DB_DUMP_SORTED, every key and its
+ * value are listed in lexicographic order, one per line.
+ *
+ * Writers never wait for a sorted dump, and only for the parts of a tree
+ * dump they touch to be formatted in memory (see above).
+ *
+ * Returns 0 on success, or -1 if the file could not be opened or written,
+ * or if memory runs out. */
+int db_dump(char *filename, int format) {
+    FILE *out = stdout;
+    int ret;
+
+    if (filename != NULL) {
+        // skip over leading whitespace
+        while (isspace(*filename)) {
+            filename++;
+        }
+
+        if (*filename != '\0' && (out = fopen(filename, "w+")) == NULL) {
+            return -1;
+        }
+    }
+
+    if (format == DB_DUMP_SORTED) {
+        ret = db_scan("", NULL, 0, dump_emit, out) < 0 ? -1 : 0;
+    } else {
+        ret = dump_tree(out);
+    }
+    if (fflush(out) != 0 || ferror(out)) ret = -1;
+
+    if (out != stdout) fclose(out);
+    return ret;
+}
+
+/* Dumps the whole database like db_dump: a single tree pre-order, while the
+ * shards of a sharded database are merged into one ordered listing, as are
+ * the tree and a mapped snapshot. */
+int db_print(char *filename) {
+    return db_dump(filename, num_shards == 1 && mapped_count() == 0
+                                 ? DB_DUMP_TREE
+                                 : DB_DUMP_SORTED);
+}
+
+// Room for one batch of a range scan
+typedef struct scan_batch {
+    char name[MAXLEN + 1];
+    char value[MAXLEN + 1];
+} scan_batch_t;
+
+// Compares the name of a record of the mapped snapshot with name, of length
+// len, like strcmp
+static int record_compare(mapped_record_t *record, const char *name,
+                          size_t len) {
+    int ret = memcmp(record->name, name,
+                     record->name_len < len ? record->name_len : len);
+
+    if (ret != 0) return ret;
+    return record->name_len < len ? -1 : record->name_len > len;
+}
+
+// Copies a record of the mapped snapshot into a batch of a range scan
+static void record_copy(mapped_record_t *record, scan_batch_t *entry) {
+    size_t len = record->value_len < MAXLEN ? record->value_len : MAXLEN;
+
+    memcpy(entry->name, record->name, record->name_len);
+    entry->name[record->name_len] = '\0';
+    memcpy(entry->value, record->value, len);
+    entry->value[len] = '\0';
+}
+
+/* Does the work of db_scan with the given cursors (one per shard) and batch.
+ * The keys of the mapped snapshot, if any, are merged in too, except those
+ * shadowed by the tree. A key being copied into the tree may briefly be in
+ * both, with the same value, and is then taken from the tree. */
+static int scan_range(cursor_t *cursors, scan_batch_t *batch, char *start,
+                      char *end, int limit,
+                      void (*emit)(char *name, char *value, void *arg),
+                      void *arg) {
+    char last[MAXLEN + 1];
+    mapped_record_t record;
+    node_t *node;
+    node_t *min;
+    int min_shard = 0;
+    long mapped_end = mapped_count();
+    long next_record;
+    db_key_t from;
+    int after = 0;
+    int count = 0;
+    int n = SCAN_BATCH;
+    int ret;
+
+    key_init(&from, start);
+    while (n == SCAN_BATCH && (limit == 0 || count < limit)) {
+        for (int i = 0; i < num_shards; i++) {
+            cursor_seek(&cursors[i], &heads[i], &from, after);
+        }
+        next_record = mapped_end == 0 ? 0 : mapped_seek(from.name, from.len,
+                                                        after);
+
+        for (n = 0; n < SCAN_BATCH && (limit == 0 || count + n < limit);
+             n++) {
+            min = NULL;
+            for (int i = 0; i < num_shards; i++) {
+                node = cursor_node(&cursors[i]);
+                if (node != NULL &&
+                    (min == NULL || strcmp(node->name, min->name) < 0)) {
+                    min = node;
+                    min_shard = i;
+                }
+            }
+
+            // Skipping shadowed and corrupt records, record being the next
+            // one left
+            while (next_record < mapped_end &&
+                   (mapped_shadowed(next_record) ||
+                    mapped_get(next_record, &record) < 0)) {
+                next_record++;
+            }
+            if (next_record < mapped_end) {
+                ret = min == NULL ? -1
+                                  : record_compare(&record, min->name,
+                                                   min->name_len);
+                if (ret == 0) {
+                    next_record++;
+                } else if (ret < 0) {
+                    if (end != NULL &&
+                        record_compare(&record, end, strlen(end)) >= 0) {
+                        break;
+                    }
+                    record_copy(&record, &batch[n]);
+                    next_record++;
+                    continue;
+                }
+            }
+
+            if (min == NULL || (end != NULL && strcmp(min->name, end) >= 0)) {
+                break;
+            }
+
+            memcpy(batch[n].name, min->name, min->name_len + 1);
+            memcpy(batch[n].value, min->value, min->value_len + 1);
+            cursor_next(&cursors[min_shard]);
+        }
+
+        for (int i = 0; i < num_shards; i++) {
+            cursor_close(&cursors[i]);
+        }
+
+        for (int i = 0; i < n; i++) {
+            emit(batch[i].name, batch[i].value, arg);
+        }
+        count += n;
+
+        // Picking up after the last key of the batch
+        if (n > 0) {
+            memcpy(last, batch[n - 1].name, sizeof(last));
+            key_init(&from, last);
+            after = 1;
+        }
+    }
+    return count;
+}
+
+/* Hands every key in [start, end) and its value to emit, in lexicographic
+ * order, stopping after limit keys unless limit is 0 (and at the last key if
+ * end is NULL). Keys are collected
+ * SCAN_BATCH at a time by merging cursors over all the shards; the cursors
+ * are closed before the batch is handed over, so no locks are held while
+ * emit runs, and the next batch seeks to just after the last key emitted.
+ * Every key is emitted at most once and in order, but the scan is not
+ * atomic: keys added or removed while it runs may or may not be seen.
+ *
+ * Returns the number of keys emitted, or -1 if memory runs out. */
+int db_scan(char *start, char *end, int limit,
+            void (*emit)(char *name, char *value, void *arg), void *arg) {
+    scan_batch_t *batch;
+    cursor_t *cursors;
+    void *scratch;
+    int count;
+
+    scratch = malloc(SCAN_BATCH * sizeof(scan_batch_t) +
+                     num_shards * sizeof(cursor_t));
+    if (scratch == NULL) return -1;
+    cursors = (cursor_t *)scratch;
+    batch = (scan_batch_t *)(cursors + num_shards);
+
+    // emit may well be a cancellation point
+    pthread_cleanup_push(free, scratch);
+    count = scan_range(cursors, batch, start, end, limit, emit, arg);
+    pthread_cleanup_pop(1);
+    return count;
+}
+
+// A key of a batch, along with its position in the request and its shard
+typedef struct batch_entry {
+    db_key_t key;
+    int index;
+    int shard;
+} batch_entry_t;
+
+// Orders batch entries by key
+static int batch_compare(const void *a, const void *b) {
+    const db_key_t *x = &((const batch_entry_t *)a)->key;
+    const db_key_t *y = &((const batch_entry_t *)b)->key;
+
+    if (x->prefix != y->prefix) return x->prefix < y->prefix ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+// Does the work of db_mquery with the given cursors (one per shard), the n
+// batch entries, sorted, and room for their values (a negative length
+// marking the keys not found)
+static int mquery_walk(cursor_t *cursors, batch_entry_t *batch,
+                       char (*values)[MAXLEN + 1], int *lengths, int n,
+                       void (*emit)(char *name, char *value, void *arg),
+                       void *arg) {
+    node_t *node;
+    cursor_t *cursor;
+    int count = 0;
+
+    // A negative depth marks the cursors not positioned yet
+    for (int i = 0; i < num_shards; i++) {
+        cursors[i].depth = -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        lengths[i] = mapped_value(&batch[i].key, values[i], MAXLEN + 1);
+        if (lengths[i] >= 0) continue;
+
+        cursor = &cursors[batch[i].shard];
+        if (cursor->depth < 0) {
+            cursor_seek(cursor, &heads[batch[i].shard], &batch[i].key, 0);
+        } else {
+            cursor_advance(cursor, &heads[batch[i].shard], &batch[i].key);
+        }
+
+        node = cursor_node(cursor);
+        if (node != 0 && key_compare(&batch[i].key, node) == 0) {
+            lengths[i] = copy_value(node, values[i], MAXLEN + 1);
+        }
+    }
+
+    for (int i = 0; i < num_shards; i++) {
+        cursor_close(&cursors[i]);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (lengths[i] >= 0) {
+            emit(batch[i].key.name, values[i], arg);
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Looks up n keys at once, handing each one found and its value to emit, in
+ * lexicographic order. The keys are sorted, then each shard is walked once
+ * with a cursor: every lookup carries on from the deepest node still held by
+ * the previous one whose subtree holds the key (see cursor_advance), rather
+ * than from the head, so keys close to each other share most of their
+ * descent. As in db_scan, no locks are held while emit runs, and the batch
+ * is not atomic.
+ *
+ * Returns the number of keys found, or -1 if memory runs out. */
+int db_mquery(char **names, int n,
+              void (*emit)(char *name, char *value, void *arg), void *arg) {
+    char(*values)[MAXLEN + 1];
+    batch_entry_t *batch;
+    cursor_t *cursors;
+    int *lengths;
+    void *scratch;
+    int count;
+
+    scratch = malloc(num_shards * sizeof(cursor_t) +
+                     n * (sizeof(batch_entry_t) + MAXLEN + 1 + sizeof(int)));
+    if (scratch == NULL) return -1;
+    cursors = (cursor_t *)scratch;
+    batch = (batch_entry_t *)(cursors + num_shards);
+    lengths = (int *)(batch + n);
+    values = (char(*)[MAXLEN + 1])(lengths + n);
+
+    for (int i = 0; i < n; i++) {
+        key_init(&batch[i].key, names[i]);
+        batch[i].index = i;
+        batch[i].shard = shard_of(names[i]) - heads;
+    }
+    qsort(batch, n, sizeof(batch_entry_t), batch_compare);
+
+    // emit may well be a cancellation point
+    pthread_cleanup_push(free, scratch);
+    count = mquery_walk(cursors, batch, values, lengths, n, emit, arg);
+    pthread_cleanup_pop(1);
+    return count;
+}
+
+// Sorts the indices of n names into order, so that a batch of writes goes
+// through the tree from left to right
+static int *batch_order(char **names, int n) {
+    batch_entry_t *batch;
+    int *order;
+
+    if ((batch = malloc(n * sizeof(batch_entry_t))) == NULL) return NULL;
+    if ((order = malloc(n * sizeof(int))) == NULL) {
+        free(batch);
+        return NULL;
+    }
+
+    for (int i = 0; i < n; i++) {
+        key_init(&batch[i].key, names[i]);
+        batch[i].index = i;
+        batch[i].shard = 0;
+    }
+    qsort(batch, n, sizeof(batch_entry_t), batch_compare);
+    for (int i = 0; i < n; i++) {
+        order[i] = batch[i].index;
+    }
+
+    free(batch);
+    return order;
+}
+
+/* Adds n keys with their values, in lexicographic order, which keeps the
+ * nodes near the descents of consecutive keys in cache. Each key is still
+ * added on its own, so the batch is not atomic. Returns the number of keys
+ * added, or -1 if memory runs out. */
+int db_madd(char **names, char **values, int n) {
+    int *order;
+    int count = 0;
+
+    if ((order = batch_order(names, n)) == NULL) return -1;
+    for (int i = 0; i < n; i++) {
+        count += db_add(names[order[i]], values[order[i]]);
+    }
+    free(order);
+    return count;
+}
+
+/* Removes n keys, in lexicographic order like db_madd. Returns the number
+ * of keys removed, or -1 if memory runs out. */
+int db_mremove(char **names, int n) {
+    int *order;
+    int count = 0;
+
+    if ((order = batch_order(names, n)) == NULL) return -1;
+    for (int i = 0; i < n; i++) {
+        count += db_remove(names[order[i]]);
+    }
+    free(order);
+    return count;
+}
+
+// Snapshots are written and read through a buffer this big (see mapped.h
+// for their layout)
+#define SNAPSHOT_BUFLEN (1 << 20)
+
+static void put_be(unsigned char *p, unsigned long long v, int len) {
+    for (int i = len - 1; i >= 0; i--) {
+        p[i] = v;
+        v >>= 8;
+    }
+}
+
+static unsigned long long get_be(const unsigned char *p, int len) {
+    unsigned long long v = 0;
+
+    for (int i = 0; i < len; i++) v = v << 8 | p[i];
+    return v;
+}
+
+typedef struct snapshot_writer {
+    FILE *file;
+    unsigned long count;
+    unsigned long long offset;  // Bytes written so far
+    unsigned long long *index;  // Offset of each record written
+    unsigned long capacity;     // Room in index
+    int failed;
+} snapshot_writer_t;
+
+// Appends a key to the snapshot (see db_snapshot)
+static void snapshot_emit(char *name, char *value, void *arg) {
+    snapshot_writer_t *writer = (snapshot_writer_t *)arg;
+    unsigned char lengths[SNAPSHOT_RECORD_HEADER_LEN];
+    size_t name_len = strlen(name);
+    size_t value_len = strlen(value);
+    unsigned long long *index;
+
+    if (writer->failed) return;
+    if (writer->count == writer->capacity) {
+        writer->capacity = writer->capacity == 0 ? 1024 : 2 * writer->capacity;
+        index = realloc(writer->index, writer->capacity * sizeof(*index));
+        if (index == NULL) {
+            writer->failed = 1;
+            return;
+        }
+        writer->index = index;
+    }
+    writer->index[writer->count++] = writer->offset;
+
+    put_be(lengths, name_len, 2);
+    put_be(&lengths[2], value_len, 2);
+    if (fwrite(lengths, 1, sizeof(lengths), writer->file) != sizeof(lengths) ||
+        fwrite(name, 1, name_len, writer->file) != name_len ||
+        fwrite(value, 1, value_len, writer->file) != value_len) {
+        writer->failed = 1;
+    }
+    writer->offset += sizeof(lengths) + name_len + value_len;
+}
+
+// Does the work of db_snapshot with the temporary file open
+static int write_snapshot(snapshot_writer_t *writer) {
+    unsigned char header[SNAPSHOT_HEADER_LEN];
+    unsigned char offset[8];
+
+    memcpy(header, SNAPSHOT_MAGIC, 8);
+    put_be(&header[16], wal_checkpoint(), 8);
+    if (fwrite(header, 1, SNAPSHOT_HEADER_LEN, writer->file) !=
+        SNAPSHOT_HEADER_LEN) {
+        return -1;
+    }
+    writer->offset = SNAPSHOT_HEADER_LEN;
+
+    if (db_scan("", NULL, 0, snapshot_emit, writer) < 0 || writer->failed) {
+        return -1;
+    }
+
+    // The index and the count are only known now
+    put_be(&header[8], writer->count, 8);
+    put_be(&header[24], writer->offset, 8);
+    for (unsigned long i = 0; i < writer->count; i++) {
+        put_be(offset, writer->index[i], 8);
+        if (fwrite(offset, 1, 8, writer->file) != 8) return -1;
+    }
+    if (fseeko(writer->file, 0, SEEK_SET) < 0 ||
+        fwrite(header, 1, SNAPSHOT_HEADER_LEN, writer->file) !=
+            SNAPSHOT_HEADER_LEN ||
+        fflush(writer->file) == EOF || fsync(fileno(writer->file)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Writes a snapshot of the database to filename. Returns the number of keys
+ * in it, or -1 on failure.
+ *
+ * The snapshot is taken by a range scan, so clients go on reading and
+ * writing the database meanwhile, which is only ever locked a batch of keys
+ * at a time. Each key is saved as it was at some point during the scan;
+ * changes made while it runs may or may not make it in, but all of them are
+ * in the write-ahead log past the offset recorded in the snapshot, and
+ * replaying the log from there on brings the snapshot up to date (see
+ * wal_checkpoint). The snapshot is written to a temporary file first and
+ * renamed once complete, so a crash leaves the previous one in place. */
+long db_snapshot(char *filename) {
+    snapshot_writer_t writer = {NULL, 0, 0, NULL, 0, 0};
+    char *tmp;
+    int ret;
+
+    if (asprintf(&tmp, "%s.tmp", filename) < 0) return -1;
+    if ((writer.file = fopen(tmp, "w")) == NULL) {
+        free(tmp);
+        return -1;
+    }
+    setvbuf(writer.file, NULL, _IOFBF, SNAPSHOT_BUFLEN);
+
+    ret = write_snapshot(&writer);
+    if (fclose(writer.file) == EOF) ret = -1;
+    if (ret == 0 && rename(tmp, filename) < 0) ret = -1;
+    if (ret < 0) unlink(tmp);
+
+    free(writer.index);
+    free(tmp);
+    return ret < 0 ? -1 : (long)writer.count;
+}
+
+// Links the n nodes, in order, into a balanced tree, returning its root
+static node_t *build_tree(node_t **nodes, size_t n) {
+    node_t *root;
+
+    if (n == 0) return 0;
+    root = nodes[n / 2];
+    root->lchild = build_tree(nodes, n / 2);
+    root->rchild = build_tree(&nodes[n / 2 + 1], n - n / 2 - 1);
+    fix_height(root);
+    return root;
+}
+
+// Reads the count keys of a snapshot into new nodes, checking that they
+// are in order. Returns 0, or -1 if the snapshot is corrupt.
+static int read_snapshot(FILE *file, node_t **nodes, size_t count) {
+    unsigned char lengths[SNAPSHOT_RECORD_HEADER_LEN];
+    char name[MAXLEN + 1];
+    char value[MAXLEN + 1];
+    size_t name_len;
+    size_t value_len;
+    db_key_t key;
+
+    for (size_t i = 0; i < count; i++) {
+        if (fread(lengths, 1, sizeof(lengths), file) != sizeof(lengths)) {
+            return -1;
+        }
+        name_len = get_be(lengths, 2);
+        value_len = get_be(&lengths[2], 2);
+        if (name_len == 0 || name_len > MAXLEN || value_len > MAXLEN ||
+            fread(name, 1, name_len, file) != name_len ||
+            fread(value, 1, value_len, file) != value_len) {
+            return -1;
+        }
+        name[name_len] = '\0';
+        value[value_len] = '\0';
+
+        key_init(&key, name);
+        if (key.len != name_len || strlen(value) != value_len ||
+            (i > 0 && strcmp(name, nodes[i - 1]->name) <= 0)) {
+            return -1;
+        }
+        if ((nodes[i] = node_constructor(&key, value, 0, 0)) == 0) return -1;
+    }
+    return 0;
+}
+
+/* Loads the snapshot in filename into the database, which must be empty and
+ * not yet serving clients, and stores the log offset it was taken at in
+ * *log_offset. Returns the number of keys loaded, or -1 if the snapshot
+ * cannot be read or is corrupt (leaving the database empty).
+ *
+ * The keys come in order, so rather than adding them one by one, each tree
+ * is built balanced straight away: its nodes are gathered in an array, whose
+ * middle node becomes the root, and so on down each half. */
+long db_restore(char *filename, off_t *log_offset) {
+    unsigned char header[SNAPSHOT_HEADER_LEN];
+    node_t **nodes = NULL;
+    node_t **sorted = NULL;
+    size_t *starts = NULL;
+    size_t count;
+    size_t shard;
+    FILE *file;
+    int ret = -1;
+
+    if ((file = fopen(filename, "r")) == NULL) return -1;
+    setvbuf(file, NULL, _IOFBF, SNAPSHOT_BUFLEN);
+
+    if (fread(header, 1, SNAPSHOT_HEADER_LEN, file) != SNAPSHOT_HEADER_LEN ||
+        memcmp(header, SNAPSHOT_MAGIC, 8) != 0) {
+        fclose(file);
+        return -1;
+    }
+    count = get_be(&header[8], 8);
+    *log_offset = get_be(&header[16], 8);
+
+    if (count < ULONG_MAX / (2 * sizeof(node_t *)) &&
+        (nodes = malloc((2 * count + 1) * sizeof(node_t *))) != NULL &&
+        (starts = calloc(num_shards + 1, sizeof(size_t))) != NULL &&
+        read_snapshot(file, nodes, count) == 0) {
+        // Splitting the nodes by shard, each shard's keys staying in order
+        sorted = &nodes[count];
+        for (size_t i = 0; i < count; i++) {
+            starts[shard_of(nodes[i]->name) - heads + 1]++;
+        }
+        for (int i = 0; i < num_shards; i++) starts[i + 1] += starts[i];
+        for (size_t i = 0; i < count; i++) {
+            shard = shard_of(nodes[i]->name) - heads;
+            sorted[starts[shard]++] = nodes[i];
+        }
+
+        // Each shard's nodes now end where the next one's start
+        for (int i = 0; i < num_shards; i++) {
+            shard = i == 0 ? 0 : starts[i - 1];
+            heads[i].rchild = build_tree(&sorted[shard], starts[i] - shard);
+        }
+        STATS_ADD(stats_local()->keys, count);
+        ret = 0;
+    }
+
+    fclose(file);
+    free(nodes);
+    free(starts);
+    if (ret < 0) {
+        db_cleanup();
+        return -1;
+    }
+    return (long)count;
+}
+
+/* Maps the snapshot in filename and serves its keys from there, leaving the
+ * tree for the keys written from then on (see mapped.h). The database must
+ * be empty and not yet serving clients. Stores the log offset the snapshot
+ * was taken at in *log_offset, and returns the number of keys in it, or -1
+ * if it cannot be mapped. */
+long db_map(char *filename, off_t *log_offset) {
+    if (mapped_open(filename, log_offset, MAXLEN) < 0) return -1;
+    return mapped_count();
+}
+
+// Returns the next whitespace delimited word of *rest, which is NUL
+// terminated in place and skipped, or NULL if there is none
+static char *next_word(char **rest) {
+    char *word = *rest;
+    char *end;
+
+    while (isspace((unsigned char)*word)) word++;
+    if (*word == '\0') return NULL;
+
+    end = word;
+    while (*end != '\0' && !isspace((unsigned char)*end)) end++;
+    if (*end != '\0') *end++ = '\0';
+    *rest = end;
+    return word;
+}
+
+// A bulk load sorts its keys with one thread per this many of them, up to
+// LOAD_MAX_THREADS threads
+#define LOAD_MIN_PER_THREAD 65536
+#define LOAD_MAX_THREADS 16
+
+// A key of a bulk load, along with its value. Kept small, as they are
+// sorted by value.
+typedef struct load_entry {
+    db_key_t key;
+    char *value;
+} load_entry_t;
+
+// Part of a bulk load sorted by a thread of its own
+typedef struct load_chunk {
+    load_entry_t *entries;
+    size_t n;
+    size_t next;  // While merging, the first entry not merged yet
+    pthread_t thread;
+} load_chunk_t;
+
+// Orders load entries by key, then by position in the file
+static int load_compare(const void *a, const void *b) {
+    const db_key_t *x = &((const load_entry_t *)a)->key;
+    const db_key_t *y = &((const load_entry_t *)b)->key;
+    int ret;
+
+    if (x->prefix != y->prefix) return x->prefix < y->prefix ? -1 : 1;
+    if ((ret = strcmp(x->name, y->name)) != 0) return ret;
+    return x->name < y->name ? -1 : x->name > y->name;
+}
+
+static void *sort_chunk(void *arg) {
+    load_chunk_t *chunk = (load_chunk_t *)arg;
+
+    qsort(chunk->entries, chunk->n, sizeof(load_entry_t), load_compare);
+    return NULL;
+}
+
+// Whether word names a command (any single letter, a batch command or
+// "stats"), so that a line starting with it is no key and value
+static int is_command(const char *word) {
+    return word[1] == '\0' || (word[0] == 'm' && word[2] == '\0') ||
+           strcmp(word, "stats") == 0;
+}
+
+/* Reads the keys of a bulk load from data, which is len bytes long and
+ * NUL terminated, splitting it in place. Each line holds either a key and
+ * its value, as printed by a range scan, or an add command as found in the
+ * files of the f command. Any other command is ill-formed rather than taken
+ * for a key, and so is a key that is a single letter, which is loaded as an
+ * add command instead. Returns the entries, storing how many there are in
+ * *n, or NULL if a line is ill-formed or memory runs out. */
+static load_entry_t *parse_load(char *data, size_t len, size_t *n) {
+    load_entry_t *entries;
+    size_t capacity = 0;
+    char *line = data;
+    char *end;
+    char *words[4];
+    int count;
+
+    *n = 0;
+    for (size_t i = 0; i < len; i++) capacity += data[i] == '\n';
+    if ((entries = malloc((capacity + 1) * sizeof(load_entry_t))) == NULL) {
+        return NULL;
+    }
+
+    while (*line != '\0') {
+        if ((end = strchr(line, '\n')) != NULL) *end = '\0';
+
+        count = 0;
+        while (count < 4 && (words[count] = next_word(&line)) != NULL) {
+            count++;
+        }
+        if (count == 3 && strcmp(words[0], "a") == 0) {
+            words[0] = words[1];
+            words[1] = words[2];
+            count = 2;
+        } else if (count > 0 && is_command(words[0])) {
+            count = -1;
+        }
+        if (count == 2) {
+            key_init(&entries[*n].key, words[0]);
+            entries[*n].value = words[1];
+            if (entries[*n].key.len > MAXLEN || strlen(words[1]) > MAXLEN) {
+                count = -1;
+            }
+            (*n)++;
+        }
+        if (count != 0 && count != 2) {
+            free(entries);
+            return NULL;
+        }
+
+        if (end == NULL) break;
+        line = end + 1;
+    }
+    return entries;
+}
+
+/* Sorts the n entries into sorted, dropping all but the first of the
+ * entries for each key, and returns how many are left. The entries are
+ * split between threads, each sorting its share, and the shares are then
+ * merged. */
+static size_t sort_load(load_entry_t *entries, size_t n, load_entry_t *sorted) {
+    load_chunk_t chunks[LOAD_MAX_THREADS];
+    int num_chunks = n / LOAD_MIN_PER_THREAD;
+    load_chunk_t *min;
+    size_t count = 0;
+    int error;
+
+    if (num_chunks > sysconf(_SC_NPROCESSORS_ONLN)) {
+        num_chunks = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (num_chunks > LOAD_MAX_THREADS) num_chunks = LOAD_MAX_THREADS;
+    if (num_chunks < 1) num_chunks = 1;
+
+    for (int i = 0; i < num_chunks; i++) {
+        chunks[i].entries = &entries[n * i / num_chunks];
+        chunks[i].n = n * (i + 1) / num_chunks - n * i / num_chunks;
+        chunks[i].next = 0;
+        if (i > 0 && (error = pthread_create(&chunks[i].thread, 0, sort_chunk,
+                                             &chunks[i]))) {
+            errno = error;
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    sort_chunk(&chunks[0]);
+    for (int i = 1; i < num_chunks; i++) {
+        if ((error = pthread_join(chunks[i].thread, NULL))) {
+            errno = error;
+            perror("pthread_join");
+            exit(1);
+        }
+    }
+
+    while (1) {
+        min = NULL;
+        for (int i = 0; i < num_chunks; i++) {
+            if (chunks[i].next < chunks[i].n &&
+                (min == NULL || load_compare(&chunks[i].entries[chunks[i].next],
+                                             &min->entries[min->next]) < 0)) {
+                min = &chunks[i];
+            }
+        }
+        if (min == NULL) break;
+
+        // The first entry for a key sorts first
+        if (count == 0 || strcmp(sorted[count - 1].key.name,
+                                 min->entries[min->next].key.name) != 0) {
+            sorted[count++] = min->entries[min->next];
+        }
+        min->next++;
+    }
+    return count;
+}
+
+/* Adds the n sorted entries of a shard, which may only take up to a write
+ * lock on its head at a time. If the shard is empty, the entries are built
+ * into a balanced tree straight away, and linked to the head at once,
+ * readers seeing either none of it or all of it. Otherwise they are added
+ * one by one, in order. Returns how many were added, or -1 if memory runs
+ * out. */
+static long load_shard(node_t *head, load_entry_t *entries, size_t n) {
+    node_t **nodes;
+    long count = 0;
+
+    if ((nodes = malloc((n + 1) * sizeof(node_t *))) == NULL) return -1;
+
+    lock_node(head, 1);
+    if (head->rchild != 0 || mapped_count() > 0) {
+        unlock_node(head);
+        free(nodes);
+        for (size_t i = 0; i < n; i++) {
+            materialize(&entries[i].key);
+            switch (add_node(&entries[i].key, entries[i].value, -1)) {
+                case ADD_DONE:
+                    count++;
+                    break;
+                case ADD_NO_MEMORY:
+                    return -1;
+            }
+        }
+        return count;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if ((nodes[i] = node_constructor(&entries[i].key, entries[i].value, 0,
+                                         0)) == 0) {
+            while (i > 0) node_destructor(nodes[--i]);
+            unlock_node(head);
+            free(nodes);
+            return -1;
+        }
+        wal_append(WAL_ADD, entries[i].key.name, entries[i].key.len,
+                   entries[i].value, nodes[i]->value_len);
+    }
+    store_child(head->rchild, build_tree(nodes, n));
+    STATS_ADD(stats_local()->keys, n);
+    unlock_node(head);
+
+    free(nodes);
+    return n;
+}
+
+// Does the work of db_load with the file read into data
+static long load_data(char *data, size_t len) {
+    load_entry_t *entries;
+    load_entry_t *sorted;
+    size_t *starts;
+    size_t n;
+    size_t shard;
+    long added;
+    long count = 0;
+
+    if ((entries = parse_load(data, len, &n)) == NULL) return -1;
+    if ((sorted = malloc((n + 1) * sizeof(load_entry_t))) == NULL ||
+        (starts = calloc(num_shards + 1, sizeof(size_t))) == NULL) {
+        free(sorted);
+        free(entries);
+        return -1;
+    }
+    n = sort_load(entries, n, sorted);
+
+    // Splitting the entries by shard, each shard's keys staying in order
+    // (the entries array is free again, and big enough)
+    for (size_t i = 0; i < n; i++) {
+        starts[shard_of(sorted[i].key.name) - heads + 1]++;
+    }
+    for (int i = 0; i < num_shards; i++) starts[i + 1] += starts[i];
+    for (size_t i = 0; i < n; i++) {
+        entries[starts[shard_of(sorted[i].key.name) - heads]++] = sorted[i];
+    }
+
+    for (int i = 0; i < num_shards && count >= 0; i++) {
+        shard = i == 0 ? 0 : starts[i - 1];
+        added = load_shard(&heads[i], &entries[shard], starts[i] - shard);
+        count = added < 0 ? -1 : count + added;
+    }
+
+    free(starts);
+    free(sorted);
+    free(entries);
+    return count;
+}
+
+/* Adds the keys in filename (see parse_load) to the database, like adding
+ * them one by one, but much faster when the database is empty. The keys are
+ * sorted, in parallel, and each empty shard is then built balanced from its
+ * sorted keys and linked in at once. Returns the number of keys added, or
+ * -1 if the file cannot be read, has an ill-formed line (in which case
+ * nothing is added) or memory runs out. */
+long db_load(char *filename) {
+    struct stat st;
+    char *data;
+    FILE *file;
+    long count = -1;
+    int cancel_state;
+
+    if ((file = fopen(filename, "r")) == NULL) return -1;
+    if (fstat(fileno(file), &st) < 0 ||
+        (data = malloc(st.st_size + 1)) == NULL) {
+        fclose(file);
+        return -1;
+    }
+
+    // Nothing in here is a cancellation point worth stopping at, and a load
+    // cancelled halfway would leave its shards locked
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+    if (fread(data, 1, st.st_size, file) == (size_t)st.st_size) {
+        data[st.st_size] = '\0';
+        count = load_data(data, st.st_size);
+    }
+    pthread_setcancelstate(cancel_state, NULL);
+
+    free(data);
+    fclose(file);
+    return count;
+}
+
+/* Returns the height of the tallest shard, 0 if the database is empty. */
+int db_height(void) {
+    int max = 0;
+
+    for (int i = 0; i < num_shards; i++) {
+        lock_node(&heads[i], 0);
+        if (height(heads[i].rchild) > max) max = height(heads[i].rchild);
+        unlock_node(&heads[i]);
+    }
+    return max;
+}
+
+/* Returns the number of keys in the database, counted as they are added
+ * and removed by every thread (see stats.h) rather than by walking the
+ * trees, so only approximate while keys are being added or removed. */
+long db_count(void) {
+    stats_t stats;
+
+    stats_get(&stats);
+    return stats.keys - keys_cleaned + mapped_count();
+}
+
+/* Destroys all nodes in the database other than the heads.
+ * No threads should be using the database when this is called. */
 void db_cleanup() {
-    db_cleanup_recurs(head.lchild);
-    db_cleanup_recurs(head.rchild);
+    stats_t stats;
+
+    // Nothing can be reading the retired nodes any more
+    epoch_drain();
+
+    // Every node lives in the slab allocator, so there is no need to walk
+    // the trees: all of their memory is handed back at once (destroying a
+    // node's lock does nothing with glibc's rwlocks)
+    slab_release_all();
+
+    for (int i = 0; i < num_shards; i++) {
+        heads[i].lchild = 0;
+        heads[i].rchild = 0;
+    }
+    mapped_close();
+    cache_clear();
+    stats_get(&stats);
+    keys_cleaned = stats.keys;
 }
 
-/* Interprets the given command string and calls the appropriate database
- * function. Writes up to len-1 bytes of the response message string produced
- * by the database to the response buffer. */
-void interpret_command(char *command, char *response, int len) {
-    char value[MAXLEN];
+// Writes a response line, newline included, to out
+static void respond(outbuf_t *out, const char *line) {
+    outbuf_write(out, line, strlen(line));
+}
+
+// Writes a response line formatted like printf, of at most 64 bytes, to out
+static void respond_format(outbuf_t *out, const char *format, ...) {
+    char *line = outbuf_reserve(out, 64);
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(line, 64, format, args);
+    va_end(args);
+    outbuf_commit(out, len < 64 ? len : 63);
+}
+
+// Writes a key found by a range scan to the buffer passed as arg
+static void emit_line(char *name, char *value, void *arg) {
+    int name_len = strlen(name);
+    int value_len = strlen(value);
+    char *line = outbuf_reserve((outbuf_t *)arg, name_len + value_len + 2);
+
+    memcpy(line, name, name_len);
+    line[name_len] = ' ';
+    memcpy(&line[name_len + 1], value, value_len);
+    line[name_len + value_len + 1] = '\n';
+    outbuf_commit((outbuf_t *)arg, name_len + value_len + 2);
+}
+
+static void destroy_outbuf(void *buf) {
+    outbuf_destroy((outbuf_t *)buf);
+}
+
+// Runs the commands in the given file, dropping their responses
+static void interpret_file(FILE *finput) {
     char ibuf[MAXLEN];
-    char name[MAXLEN];
-    int sscanf_ret;
+    outbuf_t discard;
+
+    outbuf_init(&discard);
+    pthread_cleanup_push(destroy_outbuf, &discard);
+    while (fgets(ibuf, sizeof(ibuf), finput) != 0) {
+        pthread_testcancel();  // fgets is not a cancellation point
+        interpret_command(ibuf, &discard);
+        outbuf_discard(&discard);
+    }
+    pthread_cleanup_pop(1);
+}
+
+/* Answers a range scan from start to end (the last key if NULL), stopping
+ * after limit keys unless it is 0. The response line counts the keys in
+ * range, so that clients know how many "key value" lines follow it (keys and
+ * values may hold spaces), which means holding the lines back until the
+ * scan is over. */
+static void respond_scan(char *start, char *end, int limit, outbuf_t *out) {
+    outbuf_t items;
+    int count;
+
+    outbuf_init(&items);
+    pthread_cleanup_push(destroy_outbuf, &items);
+    if ((count = db_scan(start, end, limit, emit_line, &items)) < 0) {
+        respond(out, "range scan failed\n");
+    } else {
+        respond_format(out, "%d keys in range\n", count);
+        outbuf_append(out, &items);
+    }
+    pthread_cleanup_pop(1);
+}
+
+// Answers a batch query of n keys like a range scan, the response line
+// counting the keys found
+static void respond_mquery(char **names, int n, outbuf_t *out) {
+    outbuf_t items;
+    int count;
+
+    outbuf_init(&items);
+    pthread_cleanup_push(destroy_outbuf, &items);
+    if ((count = db_mquery(names, n, emit_line, &items)) < 0) {
+        respond(out, "batch command failed\n");
+    } else {
+        respond_format(out, "%d of %d keys found\n", count, n);
+        outbuf_append(out, &items);
+    }
+    pthread_cleanup_pop(1);
+}
+
+/* Interprets the given command string and calls the appropriate database
+ * function, writing the response lines to out. The command is split into
+ * words in place, so it is modified. */
+
+void interpret_command(char *command, outbuf_t *out) {
+    char *words[MAX_BATCH];
+    char *values[MAX_BATCH / 2];
+    char *rest = &command[1];
+    const char *verb;
+    char *name;
+    char *value;
+    char *end;
+    char *word;
+    char *line;
+    int limit = 0;
+    long loaded;
+    int count;
+    int n;
 
     if (strlen(command) <= 1) {
-        snprintf(response, len, "ill-formed command");
+        respond(out, "ill-formed command\n");
         return;
     }
 
     // which command is it?
     switch (command[0]) {
         case 'q':
-            // Query
-            sscanf_ret = sscanf(&command[1], "%255s", name);
-            if (sscanf_ret < 1) {
-                snprintf(response, len, "ill-formed command");
+            // Query, copying the value straight to out
+            if ((name = next_word(&rest)) == NULL) {
+                respond(out, "ill-formed command\n");
                 return;
             }
-            db_query(name, response, len);
-            if (strlen(response) == 0) {
-                snprintf(response, len, "not found");
+            line = outbuf_reserve(out, MAXLEN + 2);
+            if ((n = db_lookup(name, line, MAXLEN + 1)) < 0) {
+                respond(out, "not found\n");
+                return;
             }
-
+            line[n] = '\n';
+            outbuf_commit(out, n + 1);
             return;
 
         case 'a':
             // Add to the database
-            sscanf_ret = sscanf(&command[1], "%255s %255s", name, value);
-            if (sscanf_ret < 2) {
-                snprintf(response, len, "ill-formed command");
+            if ((name = next_word(&rest)) == NULL ||
+                (value = next_word(&rest)) == NULL) {
+                respond(out, "ill-formed command\n");
                 return;
             }
             if (db_add(name, value)) {
-                snprintf(response, len, "added");
+                respond(out, "added\n");
             } else {
-                snprintf(response, len, "already in database");
+                respond(out, "already in database\n");
             }
 
             return;
 
         case 'd':
             // Delete from the database
-            sscanf_ret = sscanf(&command[1], "%255s", name);
-            if (sscanf_ret < 1) {
-                snprintf(response, len, "ill-formed command");
+            if ((name = next_word(&rest)) == NULL) {
+                respond(out, "ill-formed command\n");
                 return;
             }
             if (db_remove(name)) {
-                snprintf(response, len, "removed");
+                respond(out, "removed\n");
+            } else {
+                respond(out, "not in database\n");
+            }
+
+            return;
+
+        case 'u':
+            // Update the value of a key in the database
+            if ((name = next_word(&rest)) == NULL ||
+                (value = next_word(&rest)) == NULL) {
+                respond(out, "ill-formed command\n");
+                return;
+            }
+            if (db_update(name, value)) {
+                respond(out, "updated\n");
             } else {
-                snprintf(response, len, "not in database");
+                respond(out, "not in database\n");
+            }
+
+            return;
+
+        case 's':
+            // Set the value of a key, adding it if need be
+            if ((name = next_word(&rest)) == NULL ||
+                (value = next_word(&rest)) == NULL) {
+                respond(out, "ill-formed command\n");
+                return;
+            }
+            switch (db_upsert(name, value)) {
+                case 1:
+                    respond(out, "updated\n");
+                    break;
+                case 2:
+                    respond(out, "added\n");
+                    break;
+                default:
+                    respond(out, "set failed\n");
+                    break;
             }
 
             return;
 
         case 'f':
             // process the commands in a file (silently)
-            sscanf_ret = sscanf(&command[1], "%255s", name);
-            if (sscanf_ret < 1) {
-                snprintf(response, len, "ill-formed command");
+            if ((name = next_word(&rest)) == NULL) {
+                respond(out, "ill-formed command\n");
                 return;
             }
 
             FILE *finput = fopen(name, "r");
             if (!finput) {
-                snprintf(response, len, "bad file name");
+                respond(out, "bad file name\n");
                 return;
             }
-            while (fgets(ibuf, sizeof(ibuf), finput) != 0) {
-                pthread_testcancel();  // fgets is not a cancellation point
-                interpret_command(ibuf, response, len);
-            }
+            interpret_file(finput);
             fclose(finput);
-            snprintf(response, len, "file processed");
+            respond(out, "file processed\n");
+            return;
+
+        case 'l':
+            // Bulk load of the keys in a file (see db_load)
+            if ((name = next_word(&rest)) == NULL) {
+                respond(out, "ill-formed command\n");
+                return;
+            }
+            if ((loaded = db_load(name)) < 0) {
+                respond(out, "load failed\n");
+            } else {
+                respond_format(out, "%ld keys loaded\n", loaded);
+            }
+            return;
+
+        case 'r':
+            // Range scan (see respond_scan)
+            if ((name = next_word(&rest)) == NULL) {
+                respond(out, "ill-formed range command\n");
+                return;
+            }
+            // Without an end, the scan goes on to the last key
+            end = next_word(&rest);
+            if ((word = next_word(&rest)) != NULL) limit = atoi(word);
+            if (limit < 0) {
+                respond(out, "ill-formed range command\n");
+                return;
+            }
+            respond_scan(name, end, limit, out);
+            return;
+
+        case 'm':
+            // Batch of queries ("mq <key>..."), adds ("ma <key> <value>...")
+            // or removes ("md <key>..."). The keys found by queries follow
+            // the response line, which counts them, like a range scan's.
+            rest = &command[2];
+            for (n = 0; n < MAX_BATCH && (word = next_word(&rest)) != NULL;
+                 n++) {
+                words[n] = word;
+            }
+            if (!isspace((unsigned char)command[2]) || n == 0 ||
+                next_word(&rest) != NULL ||
+                (command[1] == 'a' && n % 2 != 0)) {
+                respond(out, "ill-formed batch command\n");
+                return;
+            }
+
+            if (command[1] == 'q') {
+                respond_mquery(words, n, out);
+                return;
+            } else if (command[1] == 'a') {
+                // Splitting the words into keys and values, in place
+                for (int i = 0; i < n / 2; i++) {
+                    values[i] = words[2 * i + 1];
+                    words[i] = words[2 * i];
+                }
+                n /= 2;
+                count = db_madd(words, values, n);
+                verb = "added";
+            } else if (command[1] == 'd') {
+                count = db_mremove(words, n);
+                verb = "removed";
+            } else {
+                respond(out, "ill-formed batch command\n");
+                return;
+            }
+
+            if (count < 0) {
+                respond(out, "batch command failed\n");
+            } else {
+                respond_format(out, "%d of %d keys %s\n", count, n, verb);
+            }
+            return;
+
+        default:
+            respond(out, "ill-formed command\n");
+            return;
+    }
+}
+
+// Writes a binary response frame to out
+static void bin_respond(outbuf_t *out, int opcode, int status, char *key,
+                        int key_len, char *value, int value_len,
+                        uint32_t arg) {
+    char *frame = outbuf_reserve(out, BIN_HEADER_LEN + key_len + value_len);
+    bin_header_t fields = {opcode, status, key_len, value_len, arg};
+
+    bin_pack((unsigned char *)frame, &fields);
+    memcpy(frame + BIN_HEADER_LEN, key, key_len);
+    memcpy(frame + BIN_HEADER_LEN + key_len, value, value_len);
+    outbuf_commit(out, BIN_HEADER_LEN + key_len + value_len);
+}
+
+// Writes a key found by a binary range scan to the buffer passed as arg
+static void emit_item(char *name, char *value, void *arg) {
+    bin_respond((outbuf_t *)arg, 'r', BIN_ITEM, name, strlen(name), value,
+                strlen(value), 0);
+}
+
+// NUL terminates the key and value of a frame in place, sliding them back
+// over the header (already unpacked): the key by two bytes and the value by
+// one, which leaves room for both terminators. Returns 0 if either is too
+// long or holds a NUL byte, 1 otherwise.
+static int bin_strings(char *frame, bin_header_t *header, char **key,
+                       char **value) {
+    char *payload = frame + BIN_HEADER_LEN;
+
+    if (header->key_len > MAXLEN || header->value_len > MAXLEN ||
+        memchr(payload, '\0', header->key_len + header->value_len) != NULL) {
+        return 0;
+    }
+
+    *key = memmove(payload - 2, payload, header->key_len);
+    (*key)[header->key_len] = '\0';
+    *value = memmove(payload + header->key_len - 1,
+                     payload + header->key_len, header->value_len);
+    (*value)[header->value_len] = '\0';
+    return 1;
+}
+
+/* Interprets a binary request frame (see proto.h) and calls the appropriate
+ * database function, writing the response frames to out. The frame is
+ * modified. */
+void interpret_binary(char *frame, outbuf_t *out) {
+    char *name;
+    char *value;
+    char *result;
+    bin_header_t header;
+    bin_header_t fields = {'q', BIN_OK, 0, 0, 0};
+    int count;
+    int n;
+
+    bin_unpack((unsigned char *)frame, &header);
+    if (!bin_strings(frame, &header, &name, &value) ||
+        (header.key_len == 0 && header.opcode != 'r') ||
+        header.arg > INT_MAX) {
+        bin_respond(out, header.opcode, BIN_ERROR, 0, 0, 0, 0, 0);
+        return;
+    }
+
+    switch (header.opcode) {
+        case 'q':
+            // Copying the value straight to out, behind its header
+            result = outbuf_reserve(out, BIN_HEADER_LEN + MAXLEN + 1);
+            n = db_lookup(name, result + BIN_HEADER_LEN, MAXLEN + 1);
+            if (n < 0) {
+                bin_respond(out, 'q', BIN_NOT_FOUND, 0, 0, 0, 0, 0);
+                return;
+            }
+            fields.value_len = n;
+            bin_pack((unsigned char *)result, &fields);
+            outbuf_commit(out, BIN_HEADER_LEN + n);
+            return;
+
+        case 'a':
+            bin_respond(out, 'a', db_add(name, value) ? BIN_OK : BIN_EXISTS,
+                        0, 0, 0, 0, 0);
+            return;
+
+        case 'd':
+            bin_respond(out, 'd', db_remove(name) ? BIN_OK : BIN_NOT_FOUND,
+                        0, 0, 0, 0, 0);
+            return;
+
+        case 'u':
+            bin_respond(out, 'u',
+                        db_update(name, value) ? BIN_OK : BIN_NOT_FOUND, 0, 0,
+                        0, 0, 0);
+            return;
+
+        case 's':
+            // The argument tells whether the key was added
+            if ((n = db_upsert(name, value)) == 0) {
+                bin_respond(out, 's', BIN_ERROR, 0, 0, 0, 0, 0);
+            } else {
+                bin_respond(out, 's', BIN_OK, 0, 0, 0, 0, n == 2);
+            }
+            return;
+
+        case 'r':
+            // An empty end key scans to the last key
+            if ((count = db_scan(name, header.value_len > 0 ? value : NULL,
+                                 header.arg, emit_item, out)) < 0) {
+                bin_respond(out, 'r', BIN_ERROR, 0, 0, 0, 0, 0);
+            } else {
+                bin_respond(out, 'r', BIN_OK, 0, 0, 0, 0, count);
+            }
             return;
 
         default:
-            snprintf(response, len, "ill-formed command");
+            bin_respond(out, header.opcode, BIN_ERROR, 0, 0, 0, 0, 0);
             return;
     }
 }
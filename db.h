@@ -2,19 +2,52 @@
 #define DB_H_
 
 #include <pthread.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include "./outbuf.h"
 
 typedef struct node {
-    char *name;
-    char *value;
     struct node *lchild;
     struct node *rchild;
+    unsigned long prefix;   // First bytes of name, see key_compare in db.c
+    unsigned long version;  // Changes whenever keys may leave the subtree
+    int height;  // Height of the subtree rooted here, a leaf has height 1
+    unsigned short name_len;
+    unsigned short value_len;
+    char *name;   // Both point into data, except in the heads
+    char *value;
     pthread_rwlock_t lock;
+    char data[];  // name and value, each NUL terminated
 } node_t;
 
-extern node_t head;
+// Formats of db_dump
+#define DB_DUMP_TREE 0    // Each tree pre-order, indented by depth
+#define DB_DUMP_SORTED 1  // A key and its value per line, in order
 
-void interpret_command(char *command, char *response, int resp_capacity);
+int db_init(int num_shards);
+int db_cache(size_t bytes);
+void db_query(char *name, char *result, int len);
+int db_lookup(char *name, char *result, int len);
+int db_add(char *name, char *value);
+int db_remove(char *name);
+int db_update(char *name, char *value);
+int db_upsert(char *name, char *value);
+int db_scan(char *start, char *end, int limit,
+            void (*emit)(char *name, char *value, void *arg), void *arg);
+int db_mquery(char **names, int n,
+              void (*emit)(char *name, char *value, void *arg), void *arg);
+int db_madd(char **names, char **values, int n);
+int db_mremove(char **names, int n);
+void interpret_command(char *command, outbuf_t *out);
+void interpret_binary(char *frame, outbuf_t *out);
 int db_print(char *filename);
+int db_dump(char *filename, int format);
+long db_snapshot(char *filename);
+long db_restore(char *filename, off_t *log_offset);
+long db_map(char *filename, off_t *log_offset);
+long db_load(char *filename);
+int db_height(void);
+long db_count(void);
 void db_cleanup(void);
 
 #endif  // DB_H_
@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "./db.h"
+#include "./epoch.h"
+#include "./slab.h"
+
+#define KEYLEN 32
+
+// Keys per batch of the mquery phase, as for a page view
+#define BATCH 50
+
+#define SNAPSHOT_FILE "dbbench.snapshot"
+#define LOAD_FILE "dbbench.load"
+
+/*
+ * Benchmark for the database tree, run in-process so that the network and
+ * command parsing stay out of the measurements. Keys are added, queried
+ * (one by one, then BATCH at a time), updated, printed, saved to a snapshot,
+ * queried from the mapped snapshot, restored from it, bulk loaded from a
+ * file, and removed once in sorted order and once in random order, and the
+ * average latency of each operation is reported along with the height the
+ * tree reached.
+ */
+
+static char (*keys)[KEYLEN];
+static int *order;
+
+/*
+ * Returns the current time in nanoseconds.
+ */
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Shuffles the first n entries of order (Fisher-Yates) using a fixed seed,
+ * so that runs are comparable.
+ */
+static void shuffle(int n) {
+    unsigned long long state = 88172645463325252ULL;
+
+    for (int i = n - 1; i > 0; i--) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        int j = state % (i + 1);
+        int tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+}
+
+/*
+ * Prints the average latency of n operations that took the given time.
+ */
+static void report(const char *phase, int n, double elapsed) {
+    printf("%-16s %9d ops %10.1f ns/op\n", phase, n, elapsed / n);
+}
+
+/*
+ * Prints how the removed nodes have been reclaimed so far.
+ */
+static void report_reclamation(const char *label) {
+    epoch_stats_t stats;
+
+    epoch_get_stats(&stats);
+    printf("%-16s %9lu retired %9lu freed %9lu pending "
+           "%8.1f us avg lag %8.1f us max lag\n",
+           label, stats.retired, stats.freed, stats.pending, stats.avg_lag_us,
+           stats.max_lag_us);
+}
+
+/*
+ * Prints how much memory the nodes currently take.
+ */
+static void report_memory(const char *label) {
+    slab_stats_t stats;
+
+    slab_get_stats(&stats);
+    printf("%-16s %9lu KiB reserved %9lu KiB in use %9lu KiB requested "
+           "%5.1f%% fragmentation\n",
+           label, stats.reserved >> 10, stats.in_use >> 10,
+           stats.requested >> 10, 100 * stats.fragmentation);
+}
+
+/*
+ * Does nothing with a key found by db_mquery, which counts them.
+ */
+static void count_key(char *name, char *value, void *arg) {
+    (void)name;
+    (void)value;
+    (void)arg;
+}
+
+/*
+ * Adds, queries and removes all n keys in the current order.
+ */
+static void run(const char *label, int n) {
+    char *batch[BATCH];
+    char phase[32];
+    char result[256];
+    char value[KEYLEN];
+    off_t log_offset;
+    FILE *file;
+    double start;
+    int found = 0;
+
+    start = now_ns();
+    for (int i = 0; i < n; i++) {
+        if (!db_add(keys[order[i]], keys[order[i]])) {
+            fprintf(stderr, "failed to add %s\n", keys[order[i]]);
+            exit(1);
+        }
+    }
+    snprintf(phase, sizeof(phase), "%s add", label);
+    report(phase, n, now_ns() - start);
+    snprintf(phase, sizeof(phase), "%s memory", label);
+    report_memory(phase);
+    snprintf(phase, sizeof(phase), "%s height", label);
+    printf("%-16s %9d levels\n", phase, db_height());
+
+    start = now_ns();
+    for (int i = 0; i < n; i++) {
+        db_query(keys[order[i]], result, sizeof(result));
+    }
+    snprintf(phase, sizeof(phase), "%s query", label);
+    report(phase, n, now_ns() - start);
+
+    // Reported per key
+    start = now_ns();
+    for (int i = 0; i < n; i += BATCH) {
+        for (int j = 0; j < BATCH && i + j < n; j++) {
+            batch[j] = keys[order[i + j]];
+        }
+        found += db_mquery(batch, n - i < BATCH ? n - i : BATCH, count_key,
+                           NULL);
+    }
+    snprintf(phase, sizeof(phase), "%s mquery", label);
+    report(phase, n, now_ns() - start);
+    if (found != n) {
+        fprintf(stderr, "mquery found %d keys out of %d\n", found, n);
+        exit(1);
+    }
+
+    // New values of the same length, so that every update is done in place
+    start = now_ns();
+    for (int i = 0; i < n; i++) {
+        memcpy(value, keys[order[i]], KEYLEN);
+        value[0] = 'K';
+        if (!db_update(keys[order[i]], value)) {
+            fprintf(stderr, "failed to update %s\n", keys[order[i]]);
+            exit(1);
+        }
+    }
+    snprintf(phase, sizeof(phase), "%s update", label);
+    report(phase, n, now_ns() - start);
+
+    // Walks the whole tree, reported per key printed
+    start = now_ns();
+    if (db_print("/dev/null") != 0) {
+        fprintf(stderr, "failed to print the tree\n");
+        exit(1);
+    }
+    snprintf(phase, sizeof(phase), "%s print", label);
+    report(phase, n, now_ns() - start);
+
+    start = now_ns();
+    if (db_dump("/dev/null", DB_DUMP_SORTED) != 0) {
+        fprintf(stderr, "failed to dump the tree\n");
+        exit(1);
+    }
+    snprintf(phase, sizeof(phase), "%s sorted dump", label);
+    report(phase, n, now_ns() - start);
+
+    // Written out and loaded back whole, as on a restart, reported per key
+    start = now_ns();
+    if (db_snapshot(SNAPSHOT_FILE) != n) {
+        fprintf(stderr, "failed to write a snapshot\n");
+        exit(1);
+    }
+    snprintf(phase, sizeof(phase), "%s snapshot", label);
+    report(phase, n, now_ns() - start);
+
+    // Served from the mapped snapshot, whose pages are cached by now
+    db_cleanup();
+    start = now_ns();
+    if (db_map(SNAPSHOT_FILE, &log_offset) != n) {
+        fprintf(stderr, "failed to map the snapshot\n");
+        exit(1);
+    }
+    snprintf(phase, sizeof(phase), "%s map", label);
+    report(phase, n, now_ns() - start);
+
+    start = now_ns();
+    for (int i = 0; i < n; i++) {
+        db_query(keys[order[i]], result, sizeof(result));
+    }
+    snprintf(phase, sizeof(phase), "%s map query", label);
+    report(phase, n, now_ns() - start);
+
+    db_cleanup();
+    start = now_ns();
+    if (db_restore(SNAPSHOT_FILE, &log_offset) != n) {
+        fprintf(stderr, "failed to restore the snapshot\n");
+        exit(1);
+    }
+    snprintf(phase, sizeof(phase), "%s restore", label);
+    report(phase, n, now_ns() - start);
+    snprintf(phase, sizeof(phase), "%s height", label);
+    printf("%-16s %9d levels\n", phase, db_height());
+    unlink(SNAPSHOT_FILE);
+
+    // Loaded back from a file of keys and values in the current order,
+    // reported per key
+    if ((file = fopen(LOAD_FILE, "w")) == NULL) {
+        perror(LOAD_FILE);
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        fprintf(file, "%s %s\n", keys[order[i]], keys[order[i]]);
+    }
+    fclose(file);
+    db_cleanup();
+    start = now_ns();
+    if (db_load(LOAD_FILE) != n) {
+        fprintf(stderr, "failed to load the keys\n");
+        exit(1);
+    }
+    snprintf(phase, sizeof(phase), "%s load", label);
+    report(phase, n, now_ns() - start);
+    unlink(LOAD_FILE);
+
+    start = now_ns();
+    for (int i = 0; i < n; i++) {
+        if (!db_remove(keys[order[i]])) {
+            fprintf(stderr, "failed to remove %s\n", keys[order[i]]);
+            exit(1);
+        }
+    }
+    snprintf(phase, sizeof(phase), "%s remove", label);
+    report(phase, n, now_ns() - start);
+
+    snprintf(phase, sizeof(phase), "%s reclaim", label);
+    report_reclamation(phase);
+
+    db_cleanup();
+}
+
+/*
+ * The only (optional) argument is the number of keys, one million by
+ * default.
+ */
+int main(int argc, char *argv[]) {
+    int n = 1000000;
+
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [keys]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 2 && (n = atoi(argv[1])) <= 0) {
+        fprintf(stderr, "Invalid number of keys: %s\n", argv[1]);
+        return 1;
+    }
+
+    if ((keys = malloc(n * sizeof(*keys))) == NULL ||
+        (order = malloc(n * sizeof(*order))) == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    // Zero padding makes the numeric and lexicographic orders agree
+    for (int i = 0; i < n; i++) {
+        snprintf(keys[i], KEYLEN, "key%010d", i);
+        order[i] = i;
+    }
+
+    run("sorted", n);
+    shuffle(n);
+    run("random", n);
+
+    free(order);
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "./comm.h"
+#include "./db.h"
+#include "./mapped.h"
+#include "./outbuf.h"
+#include "./proto.h"
+
+/*
+ * Tests of the server's command handling, run in-process against a fresh
+ * database: commands are handed to interpret_command and interpret_binary
+ * as a worker would, or sent over a socket pair to a connection served by
+ * comm_serve, and the responses they write checked. Prints each
+ * failure and exits with 1 if there were any.
+ */
+
+static int failures;
+
+#define CHECK(cond)                                                   \
+    do {                                                              \
+        if (!(cond)) {                                                \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, \
+                    #cond);                                           \
+            failures++;                                               \
+        }                                                             \
+    } while (0)
+
+// Moves the pending output of out into buf, NUL terminated, and returns its
+// length. Output longer than len - 1 bytes is cut short.
+static size_t take_output(outbuf_t *out, char *buf, size_t len) {
+    size_t n = 0;
+    size_t part;
+
+    for (outbuf_chunk_t *chunk = out->head; chunk != NULL;
+         chunk = chunk->next) {
+        part = chunk->len < len - 1 - n ? chunk->len : len - 1 - n;
+        memcpy(&buf[n], chunk->data, part);
+        n += part;
+    }
+    buf[n] = '\0';
+    outbuf_discard(out);
+    return n;
+}
+
+// Runs a text command, leaving its response in buf
+static void run_text(const char *command, char *buf, size_t len) {
+    char line[BIN_MAX_FRAME];
+    outbuf_t out;
+
+    outbuf_init(&out);
+    snprintf(line, sizeof(line), "%s", command);
+    interpret_command(line, &out);
+    take_output(&out, buf, len);
+    outbuf_destroy(&out);
+}
+
+// Runs a binary request, leaving its response frames in buf and returning
+// their total length
+static size_t run_binary(int opcode, const char *key, const char *value,
+                         unsigned arg, char *buf, size_t len) {
+    char frame[BIN_MAX_FRAME];
+    bin_header_t header = {opcode, 0, strlen(key), strlen(value), arg};
+    outbuf_t out;
+    size_t n;
+
+    bin_pack((unsigned char *)frame, &header);
+    memcpy(&frame[BIN_HEADER_LEN], key, header.key_len);
+    memcpy(&frame[BIN_HEADER_LEN + header.key_len], value, header.value_len);
+
+    outbuf_init(&out);
+    interpret_binary(frame, &out);
+    n = take_output(&out, buf, len);
+    outbuf_destroy(&out);
+    return n;
+}
+
+// Range scans with an empty end key, or none, go on to the last key
+static void test_range_unbounded(void) {
+    char buf[4096];
+    bin_header_t header;
+    size_t n;
+    size_t offset = 0;
+    int items = 0;
+
+    db_add("apple", "1");
+    db_add("banana", "2");
+    db_add("cherry", "3");
+
+    n = run_binary('r', "b", "", 0, buf, sizeof(buf));
+    while (offset + BIN_HEADER_LEN <= n) {
+        bin_unpack((unsigned char *)&buf[offset], &header);
+        if (header.status != BIN_ITEM) break;
+        items++;
+        offset += BIN_HEADER_LEN + header.key_len + header.value_len;
+    }
+    CHECK(items == 2);
+    CHECK(offset + BIN_HEADER_LEN == n);
+    CHECK(header.status == BIN_OK && header.arg == 2);
+
+    // A bounded scan still stops at its end
+    n = run_binary('r', "a", "b", 0, buf, sizeof(buf));
+    bin_unpack((unsigned char *)&buf[n - BIN_HEADER_LEN], &header);
+    CHECK(header.status == BIN_OK && header.arg == 1);
+
+    run_text("r b", buf, sizeof(buf));
+    CHECK(strcmp(buf, "2 keys in range\nbanana 2\ncherry 3\n") == 0);
+
+    db_cleanup();
+}
+
+// Range scans and batch queries start with the number of keys listed, which
+// keys and values holding spaces (set over the binary protocol) then cannot
+// be mistaken for
+static void test_range_framing(void) {
+    char buf[4096];
+
+    run_binary('a', "a key", "a value", 0, buf, sizeof(buf));
+    db_add("b", "2");
+
+    run_text("r a c", buf, sizeof(buf));
+    CHECK(strcmp(buf, "2 keys in range\na key a value\nb 2\n") == 0);
+    run_text("mq b c", buf, sizeof(buf));
+    CHECK(strcmp(buf, "1 of 2 keys found\nb 2\n") == 0);
+    run_text("mq", buf, sizeof(buf));
+    CHECK(strcmp(buf, "ill-formed batch command\n") == 0);
+
+    db_cleanup();
+}
+
+// A key set to an empty value over the binary protocol is still found by a
+// text query, which answers with an empty line
+static void test_empty_value(void) {
+    char buf[64];
+    bin_header_t header;
+
+    run_binary('a', "emptyk", "", 0, buf, sizeof(buf));
+    bin_unpack((unsigned char *)buf, &header);
+    CHECK(header.status == BIN_OK);
+    run_text("q emptyk", buf, sizeof(buf));
+    CHECK(strcmp(buf, "\n") == 0);
+    run_text("q otherk", buf, sizeof(buf));
+    CHECK(strcmp(buf, "not found\n") == 0);
+
+    db_cleanup();
+}
+
+// Writes text to the file at path
+static void write_file(const char *path, const char *text) {
+    FILE *file;
+
+    if ((file = fopen(path, "w")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fputs(text, file);
+    fclose(file);
+}
+
+// Bulk loads take key and value lines and add commands, and refuse files
+// holding any other command rather than loading it as a key
+static void test_load_commands(void) {
+    char path[64];
+    char buf[64];
+
+    snprintf(path, sizeof(path), "/tmp/dbtest-%d.load", (int)getpid());
+    write_file(path, "a k1 v1\nd foo\n");
+    CHECK(db_load(path) == -1);
+    write_file(path, "a k1 v1\nmq foo\n");
+    CHECK(db_load(path) == -1);
+    run_text("q d", buf, sizeof(buf));
+    CHECK(strcmp(buf, "not found\n") == 0);
+
+    write_file(path, "a k1 v1\nk2 v2\na q v3\n");
+    CHECK(db_load(path) == 3);
+    run_text("q q", buf, sizeof(buf));
+    CHECK(strcmp(buf, "v3\n") == 0);
+
+    // Into shards that are no longer empty, counting only the new keys
+    write_file(path, "k2 v2\nk3 v3\n");
+    CHECK(db_load(path) == 1);
+
+    db_cleanup();
+    unlink(path);
+}
+
+// Sends input to a connection, serves every command it makes up and leaves
+// the responses in buf
+static void run_conn(const char *input, size_t input_len, char *buf,
+                     size_t len) {
+    int fds[2];
+    conn_t *conn;
+    char *command;
+    size_t n = 0;
+    ssize_t ret;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    if ((conn = conn_constructor(fds[0])) == NULL) exit(1);
+
+    // The socket buffers take it all, and comm_serve never blocks
+    while (input_len > 0) {
+        if ((ret = write(fds[1], input, input_len)) < 0) {
+            perror("write");
+            exit(1);
+        }
+        input += ret;
+        input_len -= ret;
+        while (comm_serve(conn, &command) == 0) {
+            interpret_command(command, &conn->out);
+        }
+    }
+
+    shutdown(fds[1], SHUT_WR);
+    while (comm_serve(conn, &command) == 0) {
+        interpret_command(command, &conn->out);
+    }
+    comm_shutdown(conn);
+    while (n < len - 1 && (ret = read(fds[1], &buf[n], len - 1 - n)) > 0) {
+        n += ret;
+    }
+    buf[n] = '\0';
+    close(fds[1]);
+}
+
+// Text commands may take up the whole input buffer, and longer ones are
+// answered once and dropped, without their tail being read as commands
+static void test_long_lines(void) {
+    char input[3 * CONN_BUFLEN];
+    char expected[128];
+    char buf[4096];
+    char key[16];
+    int len;
+
+    db_add("key00000001", "1");
+    len = snprintf(input, sizeof(input), "mq");
+    for (int i = 0; i < 50; i++) {
+        snprintf(key, sizeof(key), "key%08d", i);
+        len += snprintf(&input[len], sizeof(input) - len, " %s", key);
+    }
+    CHECK(len > 255);
+    len += snprintf(&input[len], sizeof(input) - len, "\nq key00000001\n");
+    run_conn(input, len, buf, sizeof(buf));
+    CHECK(strcmp(buf, "1 of 50 keys found\nkey00000001 1\n1\n") == 0);
+
+    // As many keys as fit on a line, each a single letter
+    len = snprintf(input, sizeof(input), "mq");
+    while (len < CONN_BUFLEN - 2) {
+        len += snprintf(&input[len], sizeof(input) - len, " k");
+    }
+    input[len++] = '\n';
+    run_conn(input, len, buf, sizeof(buf));
+    snprintf(expected, sizeof(expected), "0 of %d keys found\n",
+             (len - 3) / 2);
+    CHECK(strcmp(buf, expected) == 0);
+
+    // A line longer than the buffer, then one that just fits
+    memset(input, 'x', CONN_BUFLEN + 100);
+    len = CONN_BUFLEN + 100;
+    input[len++] = '\n';
+    memcpy(&input[len], "q key00000001", 13);
+    memset(&input[len + 13], ' ', CONN_BUFLEN - 14);
+    len += CONN_BUFLEN - 1;
+    input[len++] = '\n';
+    run_conn(input, len, buf, sizeof(buf));
+    snprintf(expected, sizeof(expected), "%s1\n", CONN_TOO_LONG);
+    CHECK(strcmp(buf, expected) == 0);
+
+    db_cleanup();
+}
+
+// Setting keys until memory runs out ends with db_upsert failing, rather
+// than retrying forever. Run in a child whose address space is capped, and
+// which is killed if it hangs.
+static void test_upsert_out_of_memory(void) {
+    struct rlimit limit = {64 << 20, 64 << 20};
+    char key[32];
+    int status;
+    pid_t pid;
+
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        alarm(10);
+        if (setrlimit(RLIMIT_AS, &limit) < 0) _exit(2);
+        for (long i = 0;; i++) {
+            snprintf(key, sizeof(key), "key%016ld", i);
+            if (db_upsert(key, key) == 0) _exit(0);
+        }
+    }
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void put_be(unsigned char *p, unsigned long long v, int len) {
+    for (int i = len - 1; i >= 0; i--) {
+        p[i] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+// Writes a snapshot (see mapped.h) of the n keys in names, in that order,
+// each with value "v"
+static void write_snapshot(const char *path, const char **names, int n) {
+    unsigned char header[SNAPSHOT_HEADER_LEN] = {0};
+    unsigned char bytes[8];
+    unsigned long long offset = SNAPSHOT_HEADER_LEN;
+    FILE *file;
+
+    if ((file = fopen(path, "w")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    memcpy(header, SNAPSHOT_MAGIC, 8);
+    put_be(&header[8], n, 8);
+    for (int i = 0; i < n; i++) {
+        offset += SNAPSHOT_RECORD_HEADER_LEN + strlen(names[i]) + 1;
+    }
+    put_be(&header[24], offset, 8);
+    fwrite(header, 1, sizeof(header), file);
+
+    for (int i = 0; i < n; i++) {
+        put_be(bytes, strlen(names[i]), 2);
+        put_be(&bytes[2], 1, 2);
+        fwrite(bytes, 1, SNAPSHOT_RECORD_HEADER_LEN, file);
+        fprintf(file, "%sv", names[i]);
+    }
+    offset = SNAPSHOT_HEADER_LEN;
+    for (int i = 0; i < n; i++) {
+        put_be(bytes, offset, 8);
+        fwrite(bytes, 1, 8, file);
+        offset += SNAPSHOT_RECORD_HEADER_LEN + strlen(names[i]) + 1;
+    }
+    fclose(file);
+}
+
+// A snapshot with a record whose key is too long is mapped all the same, as
+// records are only checked when read, but the record is taken as missing
+// by queries and range scans rather than copied out of bounds
+static void test_map_corrupt(void) {
+    char path[64];
+    char long_name[300];
+    char buf[64];
+    const char *names[3];
+    off_t log_offset;
+
+    snprintf(path, sizeof(path), "/tmp/dbtest-%d.snap", (int)getpid());
+    memset(long_name, 'k', sizeof(long_name) - 1);
+    long_name[sizeof(long_name) - 1] = '\0';
+
+    names[0] = "a";
+    names[1] = long_name;
+    names[2] = "z";
+    write_snapshot(path, names, 3);
+    CHECK(db_map(path, &log_offset) == 3);
+    run_text("q a", buf, sizeof(buf));
+    CHECK(strcmp(buf, "v\n") == 0);
+    snprintf(buf, sizeof(buf), "q %.50s", long_name);
+    run_text(buf, buf, sizeof(buf));
+    CHECK(strcmp(buf, "not found\n") == 0);
+    run_text("r a", buf, sizeof(buf));
+    CHECK(strcmp(buf, "2 keys in range\na v\nz v\n") == 0);
+
+    db_cleanup();
+    unlink(path);
+}
+
+int main(void) {
+    test_range_unbounded();
+    test_range_framing();
+    test_empty_value();
+    test_load_commands();
+    test_long_lines();
+    test_upsert_out_of_memory();
+    test_map_corrupt();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,235 @@
+#include "./epoch.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// How many objects a thread retires between attempts at freeing them
+#define RECLAIM_INTERVAL 64
+
+/*
+ * Readers announce the global epoch when they start and retract it when
+ * done. The global epoch only advances once every active reader has
+ * announced it, so an object retired in epoch e can no longer be reached by
+ * anyone once the global epoch is e + 2, and is freed then.
+ */
+
+typedef struct retired {
+    void *object;
+    void (*free_func)(void *);
+    unsigned long epoch;
+    unsigned long long retired_ns;
+} retired_t;
+
+// Per-thread epoch state. Records are never freed; when a thread exits, its
+// record (and anything still retired on it) is handed to the next thread
+// that registers. The counters are only written by the owning thread, so
+// keeping statistics adds no contention.
+typedef struct epoch_thread {
+    unsigned long announced;  // Epoch of the current reader, 0 if none
+    int in_use;
+    retired_t *retired;
+    int num_retired;
+    int retired_capacity;
+    unsigned long num_retired_total;
+    unsigned long num_freed_total;
+    unsigned long long lag_ns_total;
+    unsigned long long lag_ns_max;
+    struct epoch_thread *next;
+} epoch_thread_t;
+
+static unsigned long global_epoch = 1;
+static epoch_thread_t *epoch_threads;
+static pthread_mutex_t epoch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t epoch_key;
+static __thread epoch_thread_t *epoch_self;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Called on thread exit to give up the thread's record
+static void epoch_thread_exit(void *arg) {
+    epoch_thread_t *record = (epoch_thread_t *)arg;
+
+    pthread_mutex_lock(&epoch_mutex);
+    record->in_use = 0;
+    pthread_mutex_unlock(&epoch_mutex);
+}
+
+static void epoch_key_create(void) {
+    int error;
+
+    if ((error = pthread_key_create(&epoch_key, epoch_thread_exit))) {
+        errno = error;
+        perror("pthread_key_create");
+        exit(1);
+    }
+}
+
+static epoch_thread_t *epoch_register(void) {
+    epoch_thread_t *record;
+
+    pthread_once(&epoch_once, epoch_key_create);
+
+    pthread_mutex_lock(&epoch_mutex);
+    for (record = epoch_threads; record != 0; record = record->next) {
+        if (!record->in_use) break;
+    }
+    if (record == 0) {
+        if ((record = calloc(1, sizeof(epoch_thread_t))) == 0) {
+            perror("calloc");
+            exit(1);
+        }
+        record->next = epoch_threads;
+        __atomic_store_n(&epoch_threads, record, __ATOMIC_RELEASE);
+    }
+    record->in_use = 1;
+    pthread_mutex_unlock(&epoch_mutex);
+
+    pthread_setspecific(epoch_key, record);
+    epoch_self = record;
+    return record;
+}
+
+/* Starts a lock-free read. Nothing retired from now on is freed until the
+ * matching epoch_exit. Reads must not nest. */
+void epoch_enter(void) {
+    epoch_thread_t *self = epoch_self ? epoch_self : epoch_register();
+
+    __atomic_store_n(&self->announced,
+                     __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void) {
+    __atomic_store_n(&epoch_self->announced, 0, __ATOMIC_RELEASE);
+}
+
+// Advances the global epoch if every active reader has announced it
+static void epoch_try_advance(void) {
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    epoch_thread_t *record;
+
+    for (record = __atomic_load_n(&epoch_threads, __ATOMIC_ACQUIRE);
+         record != 0; record = record->next) {
+        unsigned long announced =
+            __atomic_load_n(&record->announced, __ATOMIC_SEQ_CST);
+        if (announced != 0 && announced != epoch) return;
+    }
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+// Frees an object retired on a record, accounting for how long it waited
+static void epoch_free(epoch_thread_t *record, retired_t *retired,
+                       unsigned long long now) {
+    unsigned long long lag = now - retired->retired_ns;
+
+    retired->free_func(retired->object);
+    record->lag_ns_total += lag;
+    if (lag > record->lag_ns_max) record->lag_ns_max = lag;
+    __atomic_store_n(&record->num_freed_total, record->num_freed_total + 1,
+                     __ATOMIC_RELAXED);
+}
+
+// Frees the objects retired on a record at least two epochs ago
+static void epoch_reclaim(epoch_thread_t *record) {
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    unsigned long long now = now_ns();
+    int kept = 0;
+
+    for (int i = 0; i < record->num_retired; i++) {
+        if (record->retired[i].epoch + 2 <= epoch) {
+            epoch_free(record, &record->retired[i], now);
+        } else {
+            record->retired[kept++] = record->retired[i];
+        }
+    }
+    record->num_retired = kept;
+}
+
+/* Defers free_func(object) until no lock-free reader can still hold a
+ * pointer to the object, which must already be unreachable for new
+ * readers. */
+void epoch_retire(void *object, void (*free_func)(void *)) {
+    epoch_thread_t *self = epoch_self ? epoch_self : epoch_register();
+    retired_t *retired;
+
+    if (self->num_retired == self->retired_capacity) {
+        int capacity = self->retired_capacity ? 2 * self->retired_capacity
+                                              : RECLAIM_INTERVAL;
+        retired = realloc(self->retired, capacity * sizeof(retired_t));
+        if (retired == 0) {
+            perror("realloc");
+            exit(1);
+        }
+        self->retired = retired;
+        self->retired_capacity = capacity;
+    }
+
+    // The object was unlinked before the epoch is read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    retired = &self->retired[self->num_retired];
+    retired->object = object;
+    retired->free_func = free_func;
+    retired->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    retired->retired_ns = now_ns();
+    __atomic_store_n(&self->num_retired_total, self->num_retired_total + 1,
+                     __ATOMIC_RELAXED);
+
+    if (++self->num_retired % RECLAIM_INTERVAL == 0) {
+        epoch_try_advance();
+        epoch_reclaim(self);
+    }
+}
+
+/* Frees every retired object right away. No thread may be reading or
+ * retiring when this is called. */
+void epoch_drain(void) {
+    unsigned long long now = now_ns();
+    epoch_thread_t *record;
+
+    for (record = epoch_threads; record != 0; record = record->next) {
+        for (int i = 0; i < record->num_retired; i++) {
+            epoch_free(record, &record->retired[i], now);
+        }
+        record->num_retired = 0;
+    }
+}
+
+/* Sums up the reclamation statistics of all threads. The counters are read
+ * without stopping anyone, so the totals are approximate while threads are
+ * retiring. */
+void epoch_get_stats(epoch_stats_t *stats) {
+    unsigned long long lag_ns_total = 0;
+    unsigned long long lag_ns_max = 0;
+    epoch_thread_t *record;
+
+    stats->epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    stats->retired = 0;
+    stats->freed = 0;
+
+    pthread_mutex_lock(&epoch_mutex);
+    for (record = epoch_threads; record != 0; record = record->next) {
+        stats->retired +=
+            __atomic_load_n(&record->num_retired_total, __ATOMIC_RELAXED);
+        stats->freed +=
+            __atomic_load_n(&record->num_freed_total, __ATOMIC_RELAXED);
+        lag_ns_total +=
+            __atomic_load_n(&record->lag_ns_total, __ATOMIC_RELAXED);
+        if (record->lag_ns_max > lag_ns_max) lag_ns_max = record->lag_ns_max;
+    }
+    pthread_mutex_unlock(&epoch_mutex);
+
+    stats->pending =
+        stats->retired > stats->freed ? stats->retired - stats->freed : 0;
+    stats->avg_lag_us = stats->freed ? lag_ns_total / 1000.0 / stats->freed : 0;
+    stats->max_lag_us = lag_ns_max / 1000.0;
+}
@@ -0,0 +1,26 @@
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+/*
+ * Epoch based memory reclamation. Threads that read shared structures without
+ * locks wrap each access in epoch_enter()/epoch_exit(); objects unlinked from
+ * those structures are handed to epoch_retire() and only freed once no such
+ * reader can still hold a pointer to them.
+ */
+
+typedef struct epoch_stats {
+    unsigned long epoch;    // Current global epoch
+    unsigned long retired;  // Objects retired so far
+    unsigned long freed;    // Objects freed so far
+    unsigned long pending;  // Objects retired but not yet freed
+    double avg_lag_us;      // Mean time from retirement to freeing
+    double max_lag_us;      // Longest time from retirement to freeing
+} epoch_stats_t;
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *object, void (*free_func)(void *));
+void epoch_drain(void);
+void epoch_get_stats(epoch_stats_t *stats);
+
+#endif  // EPOCH_H_
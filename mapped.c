@@ -0,0 +1,177 @@
+#include "./mapped.h"
+#include <endian.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bits in a word of the shadowed bitmap
+#define WORD_BITS (8 * sizeof(unsigned long))
+
+/*
+ * The mapped snapshot, if any. Its records are only ever read, and the
+ * shadowed bitmap only ever gains bits, so none of this needs locking.
+ */
+static struct {
+    unsigned char *data;
+    size_t len;
+    long count;  // 0 when nothing is mapped
+    size_t index_offset;
+    size_t max_len;  // Of keys and values
+    unsigned long *shadowed;  // A bit per record
+} mapped;
+
+static uint64_t get_u64(const unsigned char *p) {
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return be64toh(v);
+}
+
+/* Reads record index, which must be within the records. Returns 0, or -1
+ * if the record is corrupt (past the index, with an empty key, or a key or
+ * value too long), in which case it is taken as missing. The order of keys
+ * is not checked: keys out of place, or next to a corrupt record, may not be
+ * found by a binary search, but nothing outside the snapshot is ever read. */
+int mapped_get(long index, mapped_record_t *record) {
+    const unsigned char *p;
+    uint64_t offset = get_u64(&mapped.data[mapped.index_offset + 8 * index]);
+
+    if (offset < SNAPSHOT_HEADER_LEN ||
+        offset > mapped.index_offset - SNAPSHOT_RECORD_HEADER_LEN) {
+        return -1;
+    }
+    p = &mapped.data[offset];
+    record->name_len = (size_t)p[0] << 8 | p[1];
+    record->value_len = (size_t)p[2] << 8 | p[3];
+    record->name = (const char *)p + SNAPSHOT_RECORD_HEADER_LEN;
+    record->value = record->name + record->name_len;
+    if (record->name_len == 0 || record->name_len > mapped.max_len ||
+        record->value_len > mapped.max_len ||
+        offset + SNAPSHOT_RECORD_HEADER_LEN + record->name_len +
+                record->value_len >
+            mapped.index_offset) {
+        return -1;
+    }
+    return 0;
+}
+
+// Compares name, of length len, with the name of record index like strcmp.
+// A corrupt record compares greater than any name.
+static int compare(const char *name, size_t len, long index) {
+    mapped_record_t record;
+    int ret;
+
+    if (mapped_get(index, &record) < 0) return -1;
+    ret = memcmp(name, record.name,
+                 len < record.name_len ? len : record.name_len);
+    if (ret != 0) return ret;
+    return len < record.name_len ? -1 : len > record.name_len;
+}
+
+/* Maps the snapshot at path, whose keys are then served under the tree, and
+ * stores the log offset it was taken at in *log_offset. Keys and values
+ * longer than max_len bytes are taken as corrupt. Only the header is read;
+ * records are checked as they are read (see mapped_get). Returns 0, or -1 if
+ * the snapshot cannot be mapped or is not one. */
+int mapped_open(const char *path, off_t *log_offset, size_t max_len) {
+    struct stat st;
+    unsigned char *data;
+    uint64_t count;
+    uint64_t index_offset;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) return -1;
+    if (fstat(fd, &st) < 0 || st.st_size < SNAPSHOT_HEADER_LEN) {
+        close(fd);
+        return -1;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+
+    count = get_u64(&data[8]);
+    index_offset = get_u64(&data[24]);
+    if (memcmp(data, SNAPSHOT_MAGIC, 8) != 0 ||
+        index_offset < SNAPSHOT_HEADER_LEN ||
+        index_offset > (uint64_t)st.st_size ||
+        count > ((uint64_t)st.st_size - index_offset) / 8) {
+        munmap(data, st.st_size);
+        return -1;
+    }
+
+    mapped.shadowed = calloc((count + WORD_BITS - 1) / WORD_BITS + 1,
+                             sizeof(unsigned long));
+    if (mapped.shadowed == NULL) {
+        munmap(data, st.st_size);
+        return -1;
+    }
+    mapped.data = data;
+    mapped.len = st.st_size;
+    mapped.count = count;
+    mapped.index_offset = index_offset;
+    mapped.max_len = max_len;
+    *log_offset = get_u64(&data[16]);
+    return 0;
+}
+
+// Unmaps the snapshot, if any
+void mapped_close(void) {
+    if (mapped.data == NULL) return;
+    munmap(mapped.data, mapped.len);
+    free(mapped.shadowed);
+    memset(&mapped, 0, sizeof(mapped));
+}
+
+// Number of keys in the mapped snapshot, shadowed or not, 0 if none
+long mapped_count(void) {
+    return mapped.count;
+}
+
+/* Returns the index of the first record whose name comes after name (of
+ * length len), or is name itself unless after is set; mapped_count() if
+ * there is none. */
+long mapped_seek(const char *name, size_t len, int after) {
+    long low = 0;
+    long high = mapped.count;
+    long middle;
+    int ret;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        ret = compare(name, len, middle);
+        if (ret > 0 || (ret == 0 && after)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Returns the index of the record holding name, or -1 if there is none
+long mapped_find(const char *name, size_t len) {
+    long index;
+
+    if (mapped.count == 0) return -1;
+    index = mapped_seek(name, len, 0);
+    if (index == mapped.count || compare(name, len, index) != 0) return -1;
+    return index;
+}
+
+// Whether record index has been copied into the tree
+int mapped_shadowed(long index) {
+    return (__atomic_load_n(&mapped.shadowed[index / WORD_BITS],
+                            __ATOMIC_ACQUIRE) >>
+            (index % WORD_BITS)) &
+           1;
+}
+
+// Marks record index as copied into the tree, once the copy is linked
+void mapped_shadow(long index) {
+    __atomic_fetch_or(&mapped.shadowed[index / WORD_BITS],
+                      1UL << (index % WORD_BITS), __ATOMIC_RELEASE);
+}
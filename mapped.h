@@ -0,0 +1,48 @@
+#ifndef MAPPED_H_
+#define MAPPED_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Snapshot files (see db_snapshot in db.c). A snapshot starts with a header
+ * of SNAPSHOT_HEADER_LEN bytes, big-endian like the binary protocol:
+ *
+ *   0   magic         8 bytes, SNAPSHOT_MAGIC
+ *   8   count         8 bytes, number of keys
+ *   16  log offset    8 bytes, see wal_checkpoint
+ *   24  index offset  8 bytes
+ *
+ * It is followed by count records in lexicographic order of their keys,
+ * each the length of the key and of the value (2 bytes each) and then the
+ * key and the value themselves, and finally by the index: the offset of
+ * every record, 8 bytes each, so that records can be binary searched.
+ *
+ * Rather than being loaded into the tree, a snapshot can be mapped into
+ * memory and served as it is, which takes no time at all: its keys then lie
+ * under those of the tree, read-only, each record being checked as it is
+ * read (see mapped_get). A key of the snapshot is copied into the tree the
+ * first time it is written, and marked as shadowed, after which only the
+ * tree has it (and removing it from the tree removes it from the database).
+ */
+#define SNAPSHOT_MAGIC "DBSNAP01"
+#define SNAPSHOT_HEADER_LEN 32
+#define SNAPSHOT_RECORD_HEADER_LEN 4
+
+typedef struct mapped_record {
+    const char *name;  // Neither is NUL terminated
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+} mapped_record_t;
+
+int mapped_open(const char *path, off_t *log_offset, size_t max_len);
+void mapped_close(void);
+long mapped_count(void);
+long mapped_find(const char *name, size_t len);
+long mapped_seek(const char *name, size_t len, int after);
+int mapped_get(long index, mapped_record_t *record);
+int mapped_shadowed(long index);
+void mapped_shadow(long index);
+
+#endif  // MAPPED_H_
@@ -0,0 +1,259 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "./db.h"
+#include "./stats.h"
+
+/*
+ * Multi-threaded benchmark for the database, run in-process so that the
+ * network and command parsing stay out of the measurements. Each workload
+ * is run with 1, 2, 4... threads up to a maximum, all starting at once on a
+ * fresh database, and reported as the throughput of all threads together
+ * and how long they spent waiting for node locks held by one another.
+ *
+ * Workloads query, add, remove and update keys drawn at random from a key
+ * space twice the number of keys set up front (so that half the adds and
+ * removes find their key missing or present), in proportions given by each,
+ * except for two: sorted-insert adds new keys, each thread in increasing
+ * order, all at the right edge of the tree, and delete-heavy removes the
+ * keys set up front, each thread its own share, in random order, along with
+ * a query for every four removals.
+ */
+
+#define KEYLEN 32
+#define VALUE "value"
+
+// Special workloads, see above
+#define MIX 0
+#define SORTED_INSERT 1
+#define DELETE_HEAVY 2
+
+typedef struct workload {
+    const char *name;
+    int kind;
+    int query;  // Percentages of each kind of operation, for MIX
+    int add;
+    int remove;
+    int update;
+} workload_t;
+
+static const workload_t workloads[] = {
+    {"read-only", MIX, 100, 0, 0, 0},
+    {"write-heavy", MIX, 10, 30, 30, 30},
+    {"mixed", MIX, 50, 15, 15, 20},
+    {"sorted-insert", SORTED_INSERT, 0, 100, 0, 0},
+    {"delete-heavy", DELETE_HEAVY, 20, 0, 80, 0},
+};
+
+typedef struct worker {
+    const workload_t *workload;
+    int id;
+    int num_threads;
+    long ops;
+    pthread_t thread;
+} worker_t;
+
+static long num_keys;
+static long num_ops;
+static pthread_barrier_t start_barrier;
+
+/*
+ * Returns the current time in nanoseconds.
+ */
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long next_random(unsigned long *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Runs a MIX workload's share of operations
+static void run_mix(worker_t *worker) {
+    const workload_t *workload = worker->workload;
+    unsigned long state = 88172645463325252UL + worker->id;
+    char key[KEYLEN];
+    char result[KEYLEN];
+    int op;
+
+    for (long i = 0; i < worker->ops; i++) {
+        snprintf(key, sizeof(key), "key%010lu",
+                 next_random(&state) % (2 * num_keys));
+        op = next_random(&state) % 100;
+        if (op < workload->query) {
+            db_query(key, result, sizeof(result));
+        } else if ((op -= workload->query) < workload->add) {
+            db_add(key, VALUE);
+        } else if ((op -= workload->add) < workload->remove) {
+            db_remove(key);
+        } else {
+            db_update(key, VALUE);
+        }
+    }
+}
+
+// Adds keys above all those set up front, interleaved between the threads
+static void run_sorted_insert(worker_t *worker) {
+    char key[KEYLEN];
+
+    for (long i = 0; i < worker->ops; i++) {
+        snprintf(key, sizeof(key), "key%010ld",
+                 2 * num_keys + i * worker->num_threads + worker->id);
+        db_add(key, VALUE);
+    }
+}
+
+/* Removes the keys set up front whose numbers are the thread's id modulo
+ * the number of threads, visiting them in an order scattered by a prime
+ * larger than their number, and queries one for every four removals. */
+static void run_delete_heavy(worker_t *worker) {
+    long share = (num_keys - worker->id + worker->num_threads - 1) /
+                 worker->num_threads;
+    char key[KEYLEN];
+    char result[KEYLEN];
+    long j;
+
+    for (long i = 0; i < share; i++) {
+        j = (long)((unsigned long)i * 2147483647UL % share);
+        snprintf(key, sizeof(key), "key%010ld",
+                 2 * (j * worker->num_threads + worker->id));
+        db_remove(key);
+        if (i % 4 == 3) db_query(key, result, sizeof(result));
+    }
+    worker->ops = share + share / 4;
+}
+
+static void *run_worker(void *arg) {
+    worker_t *worker = (worker_t *)arg;
+
+    pthread_barrier_wait(&start_barrier);
+    switch (worker->workload->kind) {
+        case SORTED_INSERT:
+            run_sorted_insert(worker);
+            break;
+        case DELETE_HEAVY:
+            run_delete_heavy(worker);
+            break;
+        default:
+            run_mix(worker);
+            break;
+    }
+    return NULL;
+}
+
+/*
+ * Runs a workload with the given number of threads on a fresh database
+ * holding every other key of the key space.
+ */
+static void run(const workload_t *workload, int num_threads) {
+    worker_t *workers;
+    char key[KEYLEN];
+    stats_t before;
+    stats_t after;
+    double elapsed;
+    long ops = 0;
+    int error;
+
+    if ((workers = malloc(num_threads * sizeof(worker_t))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    if (workload->kind != SORTED_INSERT) {
+        for (long i = 0; i < num_keys; i++) {
+            snprintf(key, sizeof(key), "key%010ld", 2 * i);
+            db_add(key, VALUE);
+        }
+    }
+
+    if ((error = pthread_barrier_init(&start_barrier, 0, num_threads + 1))) {
+        errno = error;
+        perror("pthread_barrier_init");
+        exit(1);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].workload = workload;
+        workers[i].id = i;
+        workers[i].num_threads = num_threads;
+        workers[i].ops = num_ops / num_threads;
+        if ((error = pthread_create(&workers[i].thread, 0, run_worker,
+                                    &workers[i]))) {
+            errno = error;
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    stats_get(&before);
+    elapsed = now_ns();
+    pthread_barrier_wait(&start_barrier);
+    for (int i = 0; i < num_threads; i++) {
+        if ((error = pthread_join(workers[i].thread, NULL))) {
+            errno = error;
+            perror("pthread_join");
+            exit(1);
+        }
+        ops += workers[i].ops;
+    }
+    elapsed = now_ns() - elapsed;
+    stats_get(&after);
+    pthread_barrier_destroy(&start_barrier);
+
+    printf("%-14s %3d threads %12.0f ops/s %11lu locks %9lu waits "
+           "%8.1f ns/op waiting %6.2f%% of the time\n",
+           workload->name, num_threads, 1e9 * ops / elapsed,
+           after.locks - before.locks, after.lock_waits - before.lock_waits,
+           (double)(after.lock_wait_ns - before.lock_wait_ns) / ops,
+           100.0 * (after.lock_wait_ns - before.lock_wait_ns) /
+               (elapsed * num_threads));
+#ifdef LOCK_PROFILE
+    stats_lock_report(stdout, &before, &after);
+#endif
+
+    db_cleanup();
+    free(workers);
+}
+
+/*
+ * The (optional) arguments are the number of keys set up front, 200000 by
+ * default, the number of operations of each run, split between its
+ * threads, one million by default, and the largest number of threads, twice
+ * the number of processors by default.
+ */
+int main(int argc, char *argv[]) {
+    int max_threads = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+
+    num_keys = 200000;
+    num_ops = 1000000;
+    if (argc > 4) {
+        fprintf(stderr, "Usage: %s [keys] [ops] [max threads]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 1 && (num_keys = atol(argv[1])) <= 0) {
+        fprintf(stderr, "Invalid number of keys: %s\n", argv[1]);
+        return 1;
+    }
+    if (argc > 2 && (num_ops = atol(argv[2])) <= 0) {
+        fprintf(stderr, "Invalid number of ops: %s\n", argv[2]);
+        return 1;
+    }
+    if (argc > 3 && (max_threads = atoi(argv[3])) <= 0) {
+        fprintf(stderr, "Invalid number of threads: %s\n", argv[3]);
+        return 1;
+    }
+
+    printf("%ld keys, %ld ops per run\n", num_keys, num_ops);
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        for (int n = 1; n <= max_threads; n *= 2) run(&workloads[i], n);
+    }
+    return 0;
+}
@@ -0,0 +1,153 @@
+#include "./outbuf.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+// Most chunks sent by a single writev
+#define OUTBUF_MAX_IOV 64
+
+void outbuf_init(outbuf_t *buf) {
+    buf->head = NULL;
+    buf->tail = NULL;
+    buf->sent = 0;
+}
+
+void outbuf_destroy(outbuf_t *buf) {
+    outbuf_chunk_t *next;
+
+    while (buf->head != NULL) {
+        next = buf->head->next;
+        free(buf->head);
+        buf->head = next;
+    }
+    buf->tail = NULL;
+    buf->sent = 0;
+}
+
+/* Returns room for len bytes at the end of the buffer, which become part of
+ * the output once passed to outbuf_commit (possibly fewer of them). */
+char *outbuf_reserve(outbuf_t *buf, size_t len) {
+    outbuf_chunk_t *chunk;
+
+    assert(len <= OUTBUF_CHUNK_LEN);
+    if (buf->tail != NULL && OUTBUF_CHUNK_LEN - buf->tail->len >= len) {
+        return &buf->tail->data[buf->tail->len];
+    }
+
+    if ((chunk = malloc(sizeof(outbuf_chunk_t))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    chunk->next = NULL;
+    chunk->len = 0;
+    if (buf->tail == NULL) {
+        buf->head = chunk;
+    } else {
+        buf->tail->next = chunk;
+    }
+    buf->tail = chunk;
+    return chunk->data;
+}
+
+// Appends the first len bytes of the last reservation to the output
+void outbuf_commit(outbuf_t *buf, size_t len) {
+    buf->tail->len += len;
+}
+
+// Appends len bytes of data to the output, spreading them over chunks
+void outbuf_write(outbuf_t *buf, const char *data, size_t len) {
+    size_t room;
+
+    while (len > 0) {
+        room = buf->tail == NULL ? 0 : OUTBUF_CHUNK_LEN - buf->tail->len;
+        if (room == 0) room = OUTBUF_CHUNK_LEN;
+        if (room > len) room = len;
+
+        memcpy(outbuf_reserve(buf, room), data, room);
+        outbuf_commit(buf, room);
+        data += room;
+        len -= room;
+    }
+}
+
+/* Moves all of the output of from, none of which may have been sent, to the
+ * end of buf, leaving from empty. Its chunks are linked in as they are, not
+ * copied. */
+void outbuf_append(outbuf_t *buf, outbuf_t *from) {
+    assert(from->sent == 0);
+    if (from->head == NULL) return;
+
+    if (buf->tail == NULL) {
+        buf->head = from->head;
+    } else {
+        buf->tail->next = from->head;
+    }
+    buf->tail = from->tail;
+    outbuf_init(from);
+}
+
+// Whether some output has not been sent yet
+int outbuf_pending(outbuf_t *buf) {
+    return buf->head != NULL &&
+           (buf->head->next != NULL || buf->sent < buf->head->len);
+}
+
+// Drops all pending output
+void outbuf_discard(outbuf_t *buf) {
+    outbuf_chunk_t *next;
+
+    if (buf->head == NULL) return;
+
+    // Keeping a chunk for what comes next
+    while (buf->head->next != NULL) {
+        next = buf->head->next;
+        free(buf->head);
+        buf->head = next;
+    }
+    buf->head->len = 0;
+    buf->sent = 0;
+}
+
+/* Writes as much pending output to fd as it takes, which must be
+ * non-blocking. Returns -1 if fd is broken, 0 otherwise. */
+int outbuf_send(outbuf_t *buf, int fd) {
+    struct iovec iov[OUTBUF_MAX_IOV];
+    outbuf_chunk_t *chunk;
+    outbuf_chunk_t *next;
+    size_t start;
+    ssize_t ret;
+    int n;
+
+    while (outbuf_pending(buf)) {
+        n = 0;
+        for (chunk = buf->head; chunk != NULL && n < OUTBUF_MAX_IOV;
+             chunk = chunk->next) {
+            start = chunk == buf->head ? buf->sent : 0;
+            if (chunk->len == start) continue;
+            iov[n].iov_base = &chunk->data[start];
+            iov[n].iov_len = chunk->len - start;
+            n++;
+        }
+
+        if ((ret = writev(fd, iov, n)) < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+
+        // Freeing the chunks sent whole, but never the last one
+        buf->sent += ret;
+        while (buf->head->next != NULL && buf->sent >= buf->head->len) {
+            buf->sent -= buf->head->len;
+            next = buf->head->next;
+            free(buf->head);
+            buf->head = next;
+        }
+    }
+
+    outbuf_discard(buf);
+    return 0;
+}
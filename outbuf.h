@@ -0,0 +1,39 @@
+#ifndef OUTBUF_H_
+#define OUTBUF_H_
+
+#include <stddef.h>
+
+/*
+ * Output buffer of a connection. Responses are formatted straight into it,
+ * and it is sent with writev. It is a list of fixed size chunks rather than
+ * one growing array, so that a long response (a big range scan) is never
+ * copied to make room for more of it, and each writev sends as many of the
+ * chunks as the socket takes.
+ */
+
+// Anything reserved at once must fit in a chunk
+#define OUTBUF_CHUNK_LEN 4096
+
+typedef struct outbuf_chunk {
+    struct outbuf_chunk *next;
+    size_t len;
+    char data[OUTBUF_CHUNK_LEN];
+} outbuf_chunk_t;
+
+typedef struct outbuf {
+    outbuf_chunk_t *head;  // Pending output, NULL until something is written
+    outbuf_chunk_t *tail;
+    size_t sent;  // Bytes of the head chunk already sent
+} outbuf_t;
+
+void outbuf_init(outbuf_t *buf);
+void outbuf_destroy(outbuf_t *buf);
+char *outbuf_reserve(outbuf_t *buf, size_t len);
+void outbuf_commit(outbuf_t *buf, size_t len);
+void outbuf_write(outbuf_t *buf, const char *data, size_t len);
+void outbuf_append(outbuf_t *buf, outbuf_t *from);
+int outbuf_pending(outbuf_t *buf);
+void outbuf_discard(outbuf_t *buf);
+int outbuf_send(outbuf_t *buf, int fd);
+
+#endif  // OUTBUF_H_
@@ -0,0 +1,82 @@
+#ifndef PROTO_H_
+#define PROTO_H_
+
+#include <stdint.h>
+
+/*
+ * The binary wire protocol. A client asks for it by sending BIN_MAGIC as the
+ * very first byte of the connection, which the server echoes back; a
+ * connection that starts with anything else speaks the text protocol.
+ *
+ * Every request and response is then a frame: a BIN_HEADER_LEN byte header
+ * followed by key_len bytes of key and value_len bytes of value. Lengths
+ * delimit the payload, so keys and values may contain whitespace (but not
+ * NUL bytes). Multi-byte header fields are in network byte order:
+ *
+ *   byte 0     opcode, one of the text command letters
+ *   byte 1     status (responses only, 0 in requests)
+ *   bytes 2-3  key length
+ *   bytes 4-7  value length
+ *   bytes 8-11 argument: the limit of a range scan, or in the response
+ *              that ends one, the number of keys sent
+ *
+ * Requests and their responses:
+ *
+ *   'q' key          -> BIN_OK with the value, or BIN_NOT_FOUND
+ *   'a' key value    -> BIN_OK, or BIN_EXISTS
+ *   'd' key          -> BIN_OK, or BIN_NOT_FOUND
+ *   'u' key value    -> BIN_OK, or BIN_NOT_FOUND
+ *   's' key value    -> BIN_OK with argument 1 if key was added, 0 if it was
+ *                       updated
+ *   'r' start end    -> one BIN_ITEM per key in [start, end) carrying the
+ *                       key and its value, then BIN_OK; an empty end
+ *                       reaches the last key
+ *
+ * Malformed requests get BIN_ERROR. A frame longer than BIN_MAX_FRAME
+ * closes the connection.
+ */
+
+#define BIN_MAGIC 0x80
+#define BIN_HEADER_LEN 12
+#define BIN_MAX_FRAME 4096
+
+#define BIN_OK 0
+#define BIN_NOT_FOUND 1
+#define BIN_EXISTS 2
+#define BIN_ERROR 3
+#define BIN_ITEM 4
+
+typedef struct bin_header {
+    uint8_t opcode;
+    uint8_t status;
+    uint16_t key_len;
+    uint32_t value_len;
+    uint32_t arg;
+} bin_header_t;
+
+// Writes header to buf in wire format
+static inline void bin_pack(unsigned char *buf, const bin_header_t *header) {
+    buf[0] = header->opcode;
+    buf[1] = header->status;
+    buf[2] = header->key_len >> 8;
+    buf[3] = header->key_len;
+    for (int i = 0; i < 4; i++) {
+        buf[4 + i] = header->value_len >> (24 - 8 * i);
+        buf[8 + i] = header->arg >> (24 - 8 * i);
+    }
+}
+
+// Reads a header in wire format from buf
+static inline void bin_unpack(const unsigned char *buf, bin_header_t *header) {
+    header->opcode = buf[0];
+    header->status = buf[1];
+    header->key_len = buf[2] << 8 | buf[3];
+    header->value_len = 0;
+    header->arg = 0;
+    for (int i = 0; i < 4; i++) {
+        header->value_len = header->value_len << 8 | buf[4 + i];
+        header->arg = header->arg << 8 | buf[8 + i];
+    }
+}
+
+#endif  // PROTO_H_
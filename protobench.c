@@ -0,0 +1,198 @@
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "./proto.h"
+
+/*
+ * Compares the text and binary protocols against a running server: over a
+ * single connection each, adds, queries and then removes the same number of
+ * keys, keeping up to depth commands in flight, and reports ops/sec for each
+ * phase.
+ */
+
+#define DEFAULT_OPS 100000
+#define DEFAULT_DEPTH 64
+#define MAX_DEPTH 1024
+#define KEYLEN 32
+
+// Returns a socket connected to server on port, or -1 on failure
+static int get_socket(const char *server, const char *port) {
+    int sock = -1;
+    struct addrinfo hints;
+    struct addrinfo *result;
+    struct addrinfo *res;
+    int err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((err = getaddrinfo(server, port, &hints, &result)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+    for (res = result; res != NULL; res = res->ai_next) {
+        if ((sock = socket(res->ai_family, res->ai_socktype,
+                           res->ai_protocol)) < 0) {
+            continue;
+        }
+        if (connect(sock, res->ai_addr, res->ai_addrlen) >= 0) break;
+        close(sock);
+    }
+    freeaddrinfo(result);
+
+    if (res == NULL) {
+        fprintf(stderr, "failed to connect to '%s'\n", server);
+        return -1;
+    }
+    return sock;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// One benchmarked connection, with separate streams for each direction
+typedef struct bench_conn {
+    int binary;
+    FILE *in;
+    FILE *out;
+} bench_conn_t;
+
+static void fail(const char *what) {
+    fprintf(stderr, "%s: connection terminated\n", what);
+    exit(1);
+}
+
+// Sends command op for key i
+static void send_command(bench_conn_t *conn, char op, int i) {
+    char key[KEYLEN];
+    char value[KEYLEN];
+    unsigned char header[BIN_HEADER_LEN];
+    bin_header_t fields = {op, 0, 0, 0, 0};
+
+    snprintf(key, sizeof(key), "%c%08d", conn->binary ? 'b' : 't', i);
+    snprintf(value, sizeof(value), "value%08d", i);
+
+    if (!conn->binary) {
+        if (op == 'a') {
+            fprintf(conn->out, "a %s %s\n", key, value);
+        } else {
+            fprintf(conn->out, "%c %s\n", op, key);
+        }
+        return;
+    }
+
+    fields.key_len = strlen(key);
+    fields.value_len = op == 'a' ? strlen(value) : 0;
+    bin_pack(header, &fields);
+    fwrite(header, 1, BIN_HEADER_LEN, conn->out);
+    fwrite(key, 1, fields.key_len, conn->out);
+    fwrite(value, 1, fields.value_len, conn->out);
+}
+
+// Reads the response to one command, returning 0 unless it reported failure
+static int read_response(bench_conn_t *conn) {
+    char line[BIN_MAX_FRAME];
+    unsigned char header[BIN_HEADER_LEN];
+    bin_header_t fields;
+
+    if (!conn->binary) {
+        if (fgets(line, sizeof(line), conn->in) == NULL) fail("text");
+        return strncmp(line, "not ", 4) == 0 ||
+               strncmp(line, "already ", 8) == 0 ||
+               strncmp(line, "ill-formed ", 11) == 0;
+    }
+
+    if (fread(header, 1, BIN_HEADER_LEN, conn->in) != BIN_HEADER_LEN) {
+        fail("binary");
+    }
+    bin_unpack(header, &fields);
+    if ((long)fields.key_len + fields.value_len > (long)sizeof(line) ||
+        fread(line, 1, fields.key_len + fields.value_len, conn->in) !=
+            (size_t)fields.key_len + fields.value_len) {
+        fail("binary");
+    }
+    return fields.status != BIN_OK;
+}
+
+// Runs ops commands op, keeping depth of them in flight. Returns ops/sec.
+static double run_phase(bench_conn_t *conn, char op, int ops, int depth) {
+    int sent = 0, received = 0, failed = 0;
+    double start = now();
+
+    while (received < ops) {
+        while (sent < ops && sent - received < depth) {
+            send_command(conn, op, sent++);
+        }
+        fflush(conn->out);
+        failed += read_response(conn);
+        received++;
+    }
+    if (failed > 0) fprintf(stderr, "%c: %d commands failed\n", op, failed);
+
+    return ops / (now() - start);
+}
+
+static void run_protocol(const char *server, const char *port, int binary,
+                         int ops, int depth) {
+    bench_conn_t conn = {binary, NULL, NULL};
+    int sock;
+    double add, query, remove;
+
+    if ((sock = get_socket(server, port)) < 0) exit(1);
+    if ((conn.in = fdopen(sock, "r")) == NULL ||
+        (conn.out = fdopen(dup(sock), "w")) == NULL) {
+        perror("fdopen");
+        exit(1);
+    }
+
+    if (binary) {
+        fputc(BIN_MAGIC, conn.out);
+        fflush(conn.out);
+        if (fgetc(conn.in) != BIN_MAGIC) {
+            fprintf(stderr, "server does not speak the binary protocol\n");
+            exit(1);
+        }
+    }
+
+    add = run_phase(&conn, 'a', ops, depth);
+    query = run_phase(&conn, 'q', ops, depth);
+    remove = run_phase(&conn, 'd', ops, depth);
+
+    printf("%-6s  add %10.0f  query %10.0f  remove %10.0f  ops/sec\n",
+           binary ? "binary" : "text", add, query, remove);
+
+    fclose(conn.out);
+    fclose(conn.in);
+}
+
+int main(int argc, char *argv[]) {
+    int ops = DEFAULT_OPS;
+    int depth = DEFAULT_DEPTH;
+
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr, "Usage: %s <servername> <port> [<ops> [<depth>]]\n",
+                argv[0]);
+        return 1;
+    }
+    if (argc >= 4) ops = atoi(argv[3]);
+    if (argc == 5) depth = atoi(argv[4]);
+    if (ops < 1 || depth < 1 || depth > MAX_DEPTH) {
+        fprintf(stderr, "ops must be positive, depth between 1 and %d\n",
+                MAX_DEPTH);
+        return 1;
+    }
+
+    printf("%d ops per phase, %d in flight\n", ops, depth);
+    run_protocol(argv[1], argv[2], 0, ops, depth);
+    run_protocol(argv[1], argv[2], 1, ops, depth);
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
@@ -13,19 +14,20 @@
 #include <unistd.h>
 #include "./comm.h"
 #include "./db.h"
+#include "./slab.h"
+#include "./stats.h"
+#include "./wal.h"
 #ifdef __APPLE__
 #include "pthread_OSX.h"
 #endif
 
 /*
- * Use the variables in this struct to synchronize your main thread with client
- * threads. Note that all client threads must have terminated before you clean
- * up the database.
+ * Use the variables in this struct to synchronize your main thread with the
+ * listener. While server_stopped is set, new clients are turned away. Note
+ * that all workers must have terminated before you clean up the database.
  */
 typedef struct server_control {
     pthread_mutex_t server_mutex;
-    pthread_cond_t server_cond;
-    int num_client_threads;
     int server_stopped;
 } server_control_t;
 
@@ -40,12 +42,12 @@ typedef struct client_control {
 } client_control_t;
 
 /*
- * The encapsulation of a client thread, i.e., the thread that handles
- * commands from clients.
+ * The encapsulation of a client. Clients have no thread of their own: a
+ * fixed pool of workers serves whichever connections have commands waiting
+ * (see run_worker).
  */
 typedef struct client {
-    pthread_t thread;
-    FILE *cxstr;  // File stream for input and output
+    conn_t *conn;  // Connection to the client
 
     // For client list
     struct client *prev;
@@ -61,17 +63,42 @@ typedef struct sig_handler {
     pthread_t thread;
 } sig_handler_t;
 
+/*
+ * Snapshots of the database are written by a thread of their own, in the
+ * background, one at a time.
+ */
+typedef struct snapshot_control {
+    pthread_mutex_t mutex;
+    char *path;  // NULL unless snapshots were asked for
+    pthread_t thread;
+    int started;  // Whether thread was started and has not been joined
+    int done;     // Whether thread is done writing
+} snapshot_control_t;
+
 client_t *thread_list_head;
 pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
-server_control_t server_struct = {PTHREAD_MUTEX_INITIALIZER,
-                                  PTHREAD_COND_INITIALIZER, 0, 0};
+server_control_t server_struct = {PTHREAD_MUTEX_INITIALIZER, 0};
 client_control_t client_struct = {PTHREAD_MUTEX_INITIALIZER,
                                   PTHREAD_COND_INITIALIZER, 0};
+snapshot_control_t snapshot_struct = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0};
+
+// The worker pool
+pthread_t *workers;
+int num_workers;
 
 // Function declarations
-void *run_client(void *arg);
+void *run_worker(void *arg);
 void *monitor_signal(void *arg);
-void thread_cleanup(void *arg);
+void client_destructor(client_t *client);
+void client_remove(client_t *client);
+void *run_snapshot(void *arg);
+void report_stats(void (*emit)(char *name, char *value, void *arg),
+                  void *arg);
+void stats_line(char *name, char *value, void *arg);
+void stats_print(char *name, char *value, void *arg);
+#ifdef LOCK_PROFILE
+void report_locks(FILE *out);
+#endif
 
 // function which unlocks a passed in mutex
 void unlock_mutex(void *arg) {
@@ -146,15 +173,10 @@ void client_control_release() {
     }
 }
 
-// Called by listener (in comm.c) to create a new client thread
-void client_constructor(FILE *cxstr) {
-    // You should create a new client_t struct here and initialize ALL
-    // of its fields. Remember that these initializations should be
-    // error-checked.
-    // TODO:
-    // Step 1: Allocate memory for a new client and set its connection stream
-    // to the input argument. DONE
-
+// Called by listener (in comm.c) to add a new client
+void client_constructor(conn_t *conn) {
+    // Allocate memory for a new client and set its connection to the input
+    // argument.
     client_t *new_client = malloc(sizeof(client_t));
 
     // Error checking the new client
@@ -163,227 +185,327 @@ void client_constructor(FILE *cxstr) {
         exit(1);
     }
 
-    new_client->cxstr = cxstr;
+    new_client->conn = conn;
     new_client->next = NULL;
     new_client->prev = NULL;
+    conn->data = new_client;
     int error;
 
-    // Step 2: Create the new client thread running the run_client routine.
-    // We cretae a thread with the server_mutex locked, to ensure proper
-    // cancellation  DONE
-    if ((error = pthread_mutex_lock(&server_struct.server_mutex))) {
-        handle_error_en(error, "pthread_mutex_lock");
-    }
-
-    // Incrementing the number of client threads, and then detaching the new
-    // thread
-    server_struct.num_client_threads++;
-    if ((error =
-             pthread_create(&new_client->thread, 0, run_client, new_client))) {
-        handle_error_en(error, "pthread_create");
-    }
-    if ((error = pthread_detach(new_client->thread))) {
-        handle_error_en(error, "pthread_detach");
-    }
-    if ((error = pthread_mutex_unlock(&server_struct.server_mutex))) {
-        handle_error_en(error, "pthread_mutex_unlock");
-    }
-}
-
-void client_destructor(client_t *client) {
-    // TODO: Free all resources associated with a client.
-    // Whatever was malloc'd in client_constructor should
-    // be freed here! DONE
-    client_t *new_client = client;
-    comm_shutdown(new_client->cxstr);
-    free(new_client);
-}
-
-// Code executed by a client thread
-void *run_client(void *arg) {
-    // Locking the server_mutex since we will be editing the num_client
-    // threads
-    int error;
-
+    // Make sure that the server is still accepting clients. The server_mutex
+    // stays locked until the client is in the list and watched, so that
+    // delete_all cannot miss it.
     if ((error = pthread_mutex_lock(&server_struct.server_mutex))) {
         handle_error_en(error, "pthread_mutex_lock");
     }
-
-    // Step 1: Make sure that the server is still accepting clients.
-    client_t *new_client = (client_t *)arg;
-
-    // If stopped, we remove the client and then call exit on the thread.
-    // The unlock function is pushed before the client_destructor is called
-    // since client_destructor contains a cancellation point
+    pthread_cleanup_push(unlock_mutex, &server_struct.server_mutex);
 
     if (server_struct.server_stopped == 1) {
-        pthread_cleanup_push(unlock_mutex, &server_struct.server_mutex);
-        server_struct.num_client_threads--;
         client_destructor(new_client);
+    } else {
+        // Add client to the client list
+        if ((error = pthread_mutex_lock(&thread_list_mutex))) {
+            handle_error_en(error, "pthread_mutex_lock");
+        }
+
+        // If there is nothing in the list, the head is just set
+        // to the newly created client
+        if (thread_list_head == NULL) {
+            thread_list_head = new_client;
 
-        // Broadcasting to the server_struct condition variable if the thread
-        // list is empty
-        if (server_struct.num_client_threads == 0) {
-            if ((error = pthread_cond_broadcast(&server_struct.server_cond))) {
-                handle_error_en(error, "pthread_broadcast");
+            // Otherwise, we iterate through the list to find the last client
+            // which does not have a next client, and set accordingly
+        } else {
+            client_t *current_client = thread_list_head;
+            while (current_client->next != NULL) {
+                current_client = current_client->next;
             }
+            // Setting the next and previous pointers of the last client and
+            // the new client
+            current_client->next = new_client;
+            new_client->prev = current_client;
         }
 
-        pthread_cleanup_pop(1);
-        pthread_exit(0);
-    }
-
-    // Step 2: Add client to the client list  DONE
+        if ((error = pthread_mutex_unlock(&thread_list_mutex))) {
+            handle_error_en(error, "pthread_mutex_unlock");
+        }
 
-    // Locking the thread_list_mutex
-    if ((error = pthread_mutex_lock(&thread_list_mutex))) {
-        handle_error_en(error, "pthread_mutex_lock");
+        // From now on, the workers serve the client
+        comm_watch(conn);
     }
 
-    // If there is nothing in the list, the head is just set
-    // to the newly created client
-    if (thread_list_head == NULL) {
-        thread_list_head = new_client;
+    pthread_cleanup_pop(1);
+}
 
-        // Otherwise, we iterate through the list to find the last client which
-        // does not have a next client, and set accordingly
-    } else {
-        client_t *current_client = thread_list_head;
-        while (current_client->next != NULL) {
-            current_client = current_client->next;
-        }
-        // Setting the next and previous pointers of the last client and the new
-        // client
-        current_client->next = new_client;
-        new_client->prev = current_client;
-    }
+void client_destructor(client_t *client) {
+    // Free all resources associated with a client.
+    comm_shutdown(client->conn);
+    free(client);
+}
 
-    // Unlocking both the thread_list_mutex and the server_struct mutex
-    if ((error = pthread_mutex_unlock(&thread_list_mutex))) {
-        handle_error_en(error, "pthread_mutex_unlock");
-    }
-    if ((error = pthread_mutex_unlock(&server_struct.server_mutex))) {
-        handle_error_en(error, "pthread_mutex_unlock");
+// Code executed by the worker threads
+// Whether a text command is the stats command, ignoring trailing whitespace
+static int is_stats(const char *command) {
+    if (strncmp(command, "stats", 5) != 0) return 0;
+    for (command += 5; *command != '\0'; command++) {
+        if (!isspace((unsigned char)*command)) return 0;
     }
+    return 1;
+}
+
+void *run_worker(void *arg) {
+    (void)arg;
+    char *command;
+    conn_t *conn;
+    unsigned long long start;
+    int letter;
+    int ret;
+    int error;
 
-    // Pushing a cleanup handler for cleaning up the thread onto the stack,
-    // since there is now a cancellation point in the comm_serve function
-    pthread_cleanup_push(thread_cleanup, new_client);
-    char response[512] = {0};
-    char command[512] = {0};
+    // Wait for a connection with commands waiting (comm_wait in comm.c),
+    // then loop comm_serve to receive its commands and output responses
+    // until it has no more for now, at which point it is watched again.
+    // Note that the client may terminate the connection at any moment, in
+    // which case writing to the connection on the server side will send
+    // this process a SIGPIPE. You must ensure that the server doesn't crash
+    // when this happens!
+    while (1) {
+        conn = comm_wait();
+
+        while ((ret = comm_serve(conn, &command)) == 0) {
+            client_control_wait();
+
+            // Every command is counted and timed (see stats.h), stats
+            // itself as none of the others
+            start = stats_now_ns();
+            letter = command[0];
+            if (conn->protocol == CONN_BINARY) {
+                interpret_binary(command, &conn->out);
+            } else if (is_stats(command)) {
+                report_stats(stats_line, &conn->out);
+                outbuf_write(&conn->out, "end of stats\n", 13);
+                letter = '\0';
+            } else {
+                interpret_command(command, &conn->out);
+            }
+            stats_command(letter, stats_now_ns() - start);
 
-    // Step 3: Loop comm_serve (in comm.c) to receive commands and output
-    //       responses. Note that the client may terminate the connection at
-    //       any moment, in which case reading/writing to the connection stream
-    //       on the server side will send this process a SIGPIPE. You must
-    //       ensure that the server doesn't crash when this happens!
+            // The changes made by a batch of commands are committed to the
+            // log before their responses are sent
+            if (!comm_ready(conn)) wal_commit();
+        }
 
-    while (comm_serve(new_client->cxstr, response, command) != -1) {
-        client_control_wait();
+        if (ret == 1) {
+            comm_watch(conn);
+            continue;
+        }
 
-        interpret_command(command, response, 512);
+        // The client is done sending commands. Removing it must not be
+        // interrupted by a cancellation, or the client list would be left
+        // inconsistent.
+        if ((error = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0))) {
+            handle_error_en(error, "pthread_setcancelstate");
+        }
+        client_remove((client_t *)conn->data);
+        if ((error = pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, 0))) {
+            handle_error_en(error, "pthread_setcancelstate");
+        }
     }
 
-    //
+    return NULL;
+}
 
-    // Step 4: When the client is done sending commands, exit the thread
-    //       cleanly.
-    // Keep the signal handler thread in mind when writing this function!
+// Starts the worker pool
+void start_workers() {
+    int error;
 
-    if ((error = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0))) {
-        handle_error_en(error, "pthread_setcancelstate");
+    for (int i = 0; i < num_workers; i++) {
+        if ((error = pthread_create(&workers[i], 0, run_worker, NULL))) {
+            handle_error_en(error, "pthread_create");
+        }
     }
-    pthread_cleanup_pop(1);
-
-    return NULL;
 }
 
 void delete_all() {
-    // TODO: Cancel every thread in the client thread list with the
-    // pthread_cancel function.
+    // Cancel every worker with the pthread_cancel function, which interrupts
+    // whatever commands they are running like it used to interrupt client
+    // threads, then wait for them all to terminate. Only then can every
+    // client be destroyed, as no worker is serving any of them any more.
     int error;
 
+    for (int i = 0; i < num_workers; i++) {
+        if ((error = pthread_cancel(workers[i]))) {
+            handle_error_en(error, "pthread_cancel");
+        }
+    }
+    for (int i = 0; i < num_workers; i++) {
+        if ((error = pthread_join(workers[i], 0))) {
+            handle_error_en(error, "pthread_join");
+        }
+    }
+
     if ((error = pthread_mutex_lock(&thread_list_mutex))) {
         handle_error_en(error, "pthread_mutex_lock");
     }
-    pthread_cleanup_push(unlock_mutex, &thread_list_mutex);
-    client_t *current_client = thread_list_head;
-    while (current_client != NULL) {
-        if ((error = pthread_cancel(current_client->thread))) {
-            handle_error_en(error, "pthread_cancel");
-        }
-        current_client = current_client->next;
+    while (thread_list_head != NULL) {
+        client_t *current_client = thread_list_head;
+        thread_list_head = current_client->next;
+        client_destructor(current_client);
+    }
+    if ((error = pthread_mutex_unlock(&thread_list_mutex))) {
+        handle_error_en(error, "pthread_mutex_unlock");
     }
-    pthread_cleanup_pop(1);
 }
 
-// Cleanup routine for client threads, called on cancels and exit.
-void thread_cleanup(void *arg) {
-    // TODO: Remove the client object from thread list and call
-    // client_destructor. This function must be thread safe! The client must
-    // be in the list before this routine is ever run.
+// Removes a client whose connection was closed from the client list and
+// destroys it. Called by the worker serving the client.
+void client_remove(client_t *client) {
     int error;
 
-    // Locking both the server_struct mutex and the threadlist mutex
-    if ((error = pthread_mutex_lock(&server_struct.server_mutex))) {
-        handle_error_en(error, "pthread_mutex_lock");
-    }
     if ((error = pthread_mutex_lock(&thread_list_mutex))) {
         handle_error_en(error, "pthread_mutex_lock");
     }
 
-    client_t *new_client = (client_t *)arg;
-
-    // If the client is the head, we just set the head to NULL
-    // and then call client_destructor
-    if (new_client == thread_list_head) {
-        if (new_client->next != NULL) {
-            thread_list_head = new_client->next;
+    // If the client is the head, we just set the head to the next client
+    if (client == thread_list_head) {
+        thread_list_head = client->next;
+        if (thread_list_head != NULL) {
             thread_list_head->prev = NULL;
-        } else {
-            thread_list_head = NULL;
         }
 
         // Otherise, we set the prev_client->next to be the next_client
         // of the current client and then set the previous pointer of the
         // next client
     } else {
-        client_t *prev_client = new_client->prev;
-        prev_client->next = new_client->next;
+        client_t *prev_client = client->prev;
+        prev_client->next = client->next;
 
         if (prev_client->next != NULL) {
             prev_client->next->prev = prev_client;
         }
     }
 
-    // Decrementing the number of clients in our list
-    client_destructor(new_client);
-    server_struct.num_client_threads--;
+    client_destructor(client);
 
-    // Broadcasting to the server_struct condition variable if the thread list
-    // is empty
-    if (server_struct.num_client_threads == 0) {
-        if ((error = pthread_cond_broadcast(&server_struct.server_cond))) {
-            handle_error_en(error, "pthread_broadcast");
-        }
+    if ((error = pthread_mutex_unlock(&thread_list_mutex))) {
+        handle_error_en(error, "pthread_mutex_unlock");
     }
+}
+
+// Writes a statistic to the output buffer passed as arg, as a "name value"
+// line like those of a range scan
+void stats_line(char *name, char *value, void *arg) {
+    outbuf_t *out = (outbuf_t *)arg;
+
+    outbuf_write(out, name, strlen(name));
+    outbuf_write(out, " ", 1);
+    outbuf_write(out, value, strlen(value));
+    outbuf_write(out, "\n", 1);
+}
+
+// Prints a statistic to the console
+void stats_print(char *name, char *value, void *arg) {
+    (void)arg;
+    printf("%s %s\n", name, value);
+}
+
+// Reports the server's statistics, each as a name and a value passed to
+// emit along with arg. Latencies are in microseconds.
+void report_stats(void (*emit)(char *name, char *value, void *arg),
+                  void *arg) {
+    static char *commands[STATS_COMMANDS] = {
+        "query", "add", "remove", "update", "set",
+        "range", "batch", "file",   "load",   "other"};
+    static const struct {
+        char *name;
+        double share;
+    } percentiles[] = {{"p50", 0.5}, {"p99", 0.99}, {"p999", 0.999}};
+    stats_t stats;
+    slab_stats_t slab;
+    char name[32];
+    char value[32];
+    int clients = 0;
+    int error;
 
-    // Unlocking both mutexes
+    if ((error = pthread_mutex_lock(&thread_list_mutex))) {
+        handle_error_en(error, "pthread_mutex_lock");
+    }
+    for (client_t *client = thread_list_head; client != NULL;
+         client = client->next) {
+        clients++;
+    }
     if ((error = pthread_mutex_unlock(&thread_list_mutex))) {
         handle_error_en(error, "pthread_mutex_unlock");
     }
-    if ((error = pthread_mutex_unlock(&server_struct.server_mutex))) {
-        handle_error_en(error, "pthread_mutex_unlock");
+    stats_get(&stats);
+    slab_get_stats(&slab);
+
+    snprintf(value, sizeof(value), "%d", clients);
+    emit("clients", value, arg);
+    snprintf(value, sizeof(value), "%ld", db_count());
+    emit("keys", value, arg);
+    snprintf(value, sizeof(value), "%d", db_height());
+    emit("height", value, arg);
+    snprintf(value, sizeof(value), "%lu", slab.reserved);
+    emit("memory_reserved", value, arg);
+    snprintf(value, sizeof(value), "%lu", slab.in_use);
+    emit("memory_in_use", value, arg);
+    snprintf(value, sizeof(value), "%lu", stats.locks);
+    emit("locks", value, arg);
+    snprintf(value, sizeof(value), "%lu", stats.lock_waits);
+    emit("lock_waits", value, arg);
+    snprintf(value, sizeof(value), "%.1f", stats.lock_wait_ns / 1e3);
+    emit("lock_wait_us", value, arg);
+    if (stats.cache_hits + stats.cache_misses > 0) {
+        snprintf(value, sizeof(value), "%lu", stats.cache_hits);
+        emit("cache_hits", value, arg);
+        snprintf(value, sizeof(value), "%lu", stats.cache_misses);
+        emit("cache_misses", value, arg);
+        snprintf(value, sizeof(value), "%.2f",
+                 100.0 * stats.cache_hits /
+                     (stats.cache_hits + stats.cache_misses));
+        emit("cache_hit_rate", value, arg);
+    }
+
+    for (int i = 0; i < STATS_COMMANDS; i++) {
+        if (stats.commands[i] == 0) continue;
+        snprintf(name, sizeof(name), "%s_count", commands[i]);
+        snprintf(value, sizeof(value), "%lu", stats.commands[i]);
+        emit(name, value, arg);
+        snprintf(name, sizeof(name), "%s_mean_us", commands[i]);
+        snprintf(value, sizeof(value), "%.1f",
+                 stats.command_ns[i] / 1e3 / stats.commands[i]);
+        emit(name, value, arg);
+        for (size_t j = 0; j < sizeof(percentiles) / sizeof(percentiles[0]);
+             j++) {
+            snprintf(name, sizeof(name), "%s_%s_us", commands[i],
+                     percentiles[j].name);
+            snprintf(value, sizeof(value), "%.1f",
+                     stats_percentile(stats.latency[i],
+                                      percentiles[j].share));
+            emit(name, value, arg);
+        }
     }
 }
 
+#ifdef LOCK_PROFILE
+// Prints every node lock taken so far by level of the tree and mode (see
+// stats_lock_report)
+void report_locks(FILE *out) {
+    stats_t stats;
+
+    stats_get(&stats);
+    stats_lock_report(out, NULL, &stats);
+}
+#endif
+
 // Code executed by the signal handler thread. For the purpose of this
 // assignment, there are two reasonable ways to implement this.
 // The one you choose will depend on logic in sig_handler_constructor.
 // 'man 7 signal' and 'man sigwait' are both helpful for making this
-// decision. One way or another, all of the server's client threads
-// should terminate on SIGINT. The server (this includes the listener
-// thread) should not, however, terminate on SIGINT!
+// decision. One way or another, all of the server's clients should be
+// disconnected on SIGINT, and whatever commands they are running cancelled.
+// The server (this includes the listener thread) should not, however,
+// terminate on SIGINT!
 void *monitor_signal(void *arg) {
     // TODO: Wait for a SIGINT to be sent to the server process and cancel
     // all client threads when one arrives.
@@ -397,26 +519,28 @@ void *monitor_signal(void *arg) {
         }
         fprintf(stderr, "SIGINT received, cancelling all clients \n");
 
-        // This cancels all client threads when the signal has arrived
-        // Setting the "stopped" variable to true, deleting all the threads,
-        // and then waiting for all threads to complete deletion before
-        // continuing
+        // This cancels all clients when the signal has arrived. Setting
+        // the "stopped" variable to true, deleting all the clients along
+        // with the workers serving them, and then starting a fresh pool of
+        // workers for the clients to come
 
         if ((error = pthread_mutex_lock(&server_struct.server_mutex))) {
             handle_error_en(error, "pthread_mutex_lock");
         }
-        server_struct.server_stopped = 1;
-        // Calling delete all
-        delete_all();
 
-        // Waiting for a client thread to signal that it has been terminated
-        while (server_struct.num_client_threads != 0) {
-            if ((error = pthread_cond_wait(&server_struct.server_cond,
-                                           &server_struct.server_mutex))) {
-                handle_error_en(error, "pthread broadcast");
+        // The server is already shutting down, with its workers gone
+        if (server_struct.server_stopped == 1) {
+            if ((error = pthread_mutex_unlock(&server_struct.server_mutex))) {
+                handle_error_en(error, "pthread_mutex_unlock");
             }
+            continue;
         }
 
+        server_struct.server_stopped = 1;
+        // Calling delete all
+        delete_all();
+        start_workers();
+
         // Resetting the stopped flag to 0
         server_struct.server_stopped = 0;
 
@@ -427,6 +551,65 @@ void *monitor_signal(void *arg) {
     }
 }
 
+// Writes a snapshot while the clients carry on (see db_snapshot in db.c)
+void *run_snapshot(void *arg) {
+    (void)arg;
+    long count;
+    int error;
+
+    if ((count = db_snapshot(snapshot_struct.path)) < 0) {
+        perror(snapshot_struct.path);
+    } else {
+        fprintf(stderr, "Wrote a snapshot of %ld keys\n", count);
+    }
+
+    if ((error = pthread_mutex_lock(&snapshot_struct.mutex))) {
+        handle_error_en(error, "pthread_mutex_lock");
+    }
+    snapshot_struct.done = 1;
+    if ((error = pthread_mutex_unlock(&snapshot_struct.mutex))) {
+        handle_error_en(error, "pthread_mutex_unlock");
+    }
+    return NULL;
+}
+
+// Starts writing a snapshot, unless one is being written already
+void snapshot_start() {
+    int error;
+
+    if ((error = pthread_mutex_lock(&snapshot_struct.mutex))) {
+        handle_error_en(error, "pthread_mutex_lock");
+    }
+    if (snapshot_struct.started && !snapshot_struct.done) {
+        fprintf(stderr, "A snapshot is being written already\n");
+    } else {
+        if (snapshot_struct.started &&
+            (error = pthread_join(snapshot_struct.thread, NULL))) {
+            handle_error_en(error, "pthread_join");
+        }
+        snapshot_struct.done = 0;
+        if ((error = pthread_create(&snapshot_struct.thread, 0, run_snapshot,
+                                    NULL))) {
+            handle_error_en(error, "pthread_create");
+        }
+        snapshot_struct.started = 1;
+    }
+    if ((error = pthread_mutex_unlock(&snapshot_struct.mutex))) {
+        handle_error_en(error, "pthread_mutex_unlock");
+    }
+}
+
+// Waits for the snapshot being written, if any
+void snapshot_wait() {
+    int error;
+
+    if (snapshot_struct.started &&
+        (error = pthread_join(snapshot_struct.thread, NULL))) {
+        handle_error_en(error, "pthread_join");
+    }
+    snapshot_struct.started = 0;
+}
+
 sig_handler_t *sig_handler_constructor() {
     // TODO: Create a thread to handle SIGINT. The thread that this function
     // creates should be the ONLY thread that ever responds to SIGINT.
@@ -465,19 +648,115 @@ void sig_handler_destructor(sig_handler_t *sighandler) {
     free(sighandler);
 }
 
-// The arguments to the server should be the port number.
+// The arguments to the server should be the port number, optionally preceded
+// by -s <shards> to split the database into that many independent trees and
+// by -w <workers> to serve the clients with that many worker threads (one per
+// core by default).
 int main(int argc, char *argv[]) {
     int error;
     // This first checks to ensure that the port number was properly
     // passed as an argument.
     int port_number;
-    if (argc != 2) {
+    int num_shards = 1;
+    char *log_path = NULL;
+    int sync_policy = WAL_SYNC_PERIODIC;
+    off_t log_offset = 0;
+    int map_snapshot = 0;
+    long cache_mb = 0;
+    long restored;
+    int opt;
+
+    num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "s:w:l:d:c:mC:")) != -1) {
+        switch (opt) {
+            case 's':
+                num_shards = atoi(optarg);
+                break;
+            case 'w':
+                num_workers = atoi(optarg);
+                break;
+            case 'l':
+                log_path = optarg;
+                break;
+            case 'c':
+                snapshot_struct.path = optarg;
+                break;
+            case 'm':
+                map_snapshot = 1;
+                break;
+            case 'C':
+                cache_mb = atol(optarg);
+                break;
+            case 'd':
+                if (strcmp(optarg, "none") == 0) {
+                    sync_policy = WAL_SYNC_NONE;
+                } else if (strcmp(optarg, "periodic") == 0) {
+                    sync_policy = WAL_SYNC_PERIODIC;
+                } else if (strcmp(optarg, "always") == 0) {
+                    sync_policy = WAL_SYNC_ALWAYS;
+                } else {
+                    fprintf(stderr, "Invalid sync policy: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr,
+                        "Usage: %s [-s shards] [-w workers] [-l log] "
+                        "[-d none|periodic|always] [-c snapshot [-m]] "
+                        "[-C cache MB] <port>\n",
+                        argv[0]);
+                exit(1);
+        }
+    }
+
+    if (optind != argc - 1) {
         fprintf(stderr, "Incorrect Arguments: Please supply port number\n");
         exit(1);
     }
 
-    // Setting the port number to be the first element of the arg array
-    port_number = atoi(argv[1]);
+    // Setting the port number to be the last element of the arg array
+    port_number = atoi(argv[optind]);
+
+    if (db_init(num_shards) == -1) {
+        fprintf(stderr, "Invalid number of shards: %d\n", num_shards);
+        exit(1);
+    }
+    if (cache_mb < 0 || db_cache(cache_mb << 20) == -1) {
+        fprintf(stderr, "Cannot set up a cache of %ld MB\n", cache_mb);
+        exit(1);
+    }
+
+    // Rebuilding the database from the last snapshot, if any, and the log
+    // since, which then records every change. A mapped snapshot is served
+    // as it is, rather than loaded into the tree.
+    if (snapshot_struct.path != NULL &&
+        access(snapshot_struct.path, F_OK) == 0) {
+        if (map_snapshot) {
+            restored = db_map(snapshot_struct.path, &log_offset);
+        } else {
+            restored = db_restore(snapshot_struct.path, &log_offset);
+        }
+        if (restored < 0) {
+            fprintf(stderr, "Cannot restore snapshot %s\n",
+                    snapshot_struct.path);
+            exit(1);
+        }
+        fprintf(stderr, "Restored %ld keys\n", restored);
+    }
+    if (log_path != NULL &&
+        wal_open(log_path, sync_policy, log_offset) == -1) {
+        perror(log_path);
+        exit(1);
+    }
+
+    if (num_workers < 1) {
+        fprintf(stderr, "Invalid number of workers: %d\n", num_workers);
+        exit(1);
+    }
+    if ((workers = malloc(num_workers * sizeof(pthread_t))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
 
     // TODO:
     // Step 1: Set up the signal handler. This also creates the mask for the
@@ -488,6 +767,7 @@ int main(int argc, char *argv[]) {
     // STEP 2: Start a listener thread for clients (see start_listener in
     // comm.c). DONE
     pthread_t listener_thread = start_listener(port_number, client_constructor);
+    start_workers();
 
     // Step 3: Loop for command line input and handle accordingly until EOF.
     while (1) {
@@ -516,26 +796,18 @@ int main(int argc, char *argv[]) {
 
         // This indicates that CTRL-D was input
         if (characters_read == 0) {
-            // Setting the "stopped" variable to true, deleting all the threads,
-            // and then waiting for all threads to complete deletion before
-            // continuing
+            // Setting the "stopped" variable to true, then deleting all the
+            // clients and workers, which returns once they are all gone
             if ((error = pthread_mutex_lock(&server_struct.server_mutex))) {
                 handle_error_en(error, "pthread_mutex_lock");
             }
-            // Setting a flag to forbid new threads from creating
+            // Setting a flag to forbid new clients from being added, for
+            // good
             server_struct.server_stopped = 1;
             // Calling delete all
             delete_all();
 
-            // Waiting for a client thread to signal that it has been terminated
-            while (server_struct.num_client_threads != 0) {
-                if ((error = pthread_cond_wait(&server_struct.server_cond,
-                                               &server_struct.server_mutex))) {
-                    handle_error_en(error, "pthread_wait");
-                }
-            }
-
-            // Unlocking the server_struct mutex once all threads are terminated
+            // Unlocking the server_struct mutex once all workers are terminated
             if ((error = pthread_mutex_unlock(&server_struct.server_mutex))) {
                 handle_error_en(error, "pthread_mutex_unlock");
             }
@@ -548,6 +820,11 @@ int main(int argc, char *argv[]) {
             // Eliminating the sig_handler
             sig_handler_destructor(signal_handler);
 
+            snapshot_wait();
+            wal_close();
+#ifdef LOCK_PROFILE
+            report_locks(stderr);
+#endif
             db_cleanup();
             exit(0);
         }
@@ -573,6 +850,46 @@ int main(int argc, char *argv[]) {
             continue;
         }
 
+        // Handling the sorted P case
+        if (strcmp(buffer_pointer, "P") == 0) {
+            // Tokenizing to retrieve the filename
+            buffer_pointer = strtok(NULL, delimiter);
+
+            if (db_dump(buffer_pointer, DB_DUMP_SORTED) == -1) {
+                fprintf(stderr, "Error Printing\n");
+            }
+
+            continue;
+        }
+
+        // Handling the stats case
+        if (strcmp(buffer_pointer, "stats") == 0) {
+            report_stats(stats_print, NULL);
+            fflush(stdout);
+            continue;
+        }
+
+        // Handling the locks case
+        if (strcmp(buffer_pointer, "locks") == 0) {
+#ifdef LOCK_PROFILE
+            report_locks(stdout);
+            fflush(stdout);
+#else
+            fprintf(stderr, "Not built with LOCK_PROFILE (see stats.h)\n");
+#endif
+            continue;
+        }
+
+        // Handling the C case
+        if (strcmp(buffer_pointer, "c") == 0) {
+            if (snapshot_struct.path == NULL) {
+                fprintf(stderr, "No snapshot file given (see -c)\n");
+            } else {
+                snapshot_start();
+            }
+            continue;
+        }
+
         // Handling the S case
         if (strcmp(buffer_pointer, "s") == 0) {
             fprintf(stderr, "Stopping all clients\n");
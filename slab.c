@@ -0,0 +1,224 @@
+#include "./slab.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Size of the chunks objects are carved from
+#define SLAB_CHUNK_SIZE (1 << 20)
+
+#define SLAB_NUM_CLASSES (SLAB_MAX_SIZE / SLAB_CLASS_SIZE)
+
+// Chunks are linked through their first bytes, which are otherwise unused
+// so that objects stay aligned to SLAB_CLASS_SIZE
+typedef struct chunk {
+    struct chunk *next;
+} chunk_t;
+
+// A free object, linked through its first bytes
+typedef struct free_object {
+    struct free_object *next;
+} free_object_t;
+
+// Per-thread allocator state. Records are never freed; when a thread exits,
+// its record (free lists and counters included) is handed to the next
+// thread that registers. The counters are only written by the owning
+// thread. They may wrap below zero when a thread frees objects allocated
+// elsewhere, which evens out when summed over all threads.
+typedef struct slab_thread {
+    int in_use;
+    free_object_t *free_lists[SLAB_NUM_CLASSES];
+    char *bump;  // Unused space at the end of the current chunk
+    char *bump_end;
+    unsigned long in_use_bytes;
+    unsigned long requested_bytes;
+    struct slab_thread *next;
+} slab_thread_t;
+
+static chunk_t *slab_chunks;
+static unsigned long slab_num_chunks;
+static slab_thread_t *slab_threads;
+static pthread_mutex_t slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_key;
+static __thread slab_thread_t *slab_self;
+
+// Called on thread exit to give up the thread's record
+static void slab_thread_exit(void *arg) {
+    slab_thread_t *record = (slab_thread_t *)arg;
+
+    pthread_mutex_lock(&slab_mutex);
+    record->in_use = 0;
+    pthread_mutex_unlock(&slab_mutex);
+}
+
+static void slab_key_create(void) {
+    int error;
+
+    if ((error = pthread_key_create(&slab_key, slab_thread_exit))) {
+        errno = error;
+        perror("pthread_key_create");
+        exit(1);
+    }
+}
+
+static slab_thread_t *slab_register(void) {
+    slab_thread_t *record;
+
+    pthread_once(&slab_once, slab_key_create);
+
+    pthread_mutex_lock(&slab_mutex);
+    for (record = slab_threads; record != 0; record = record->next) {
+        if (!record->in_use) break;
+    }
+    if (record == 0) {
+        if ((record = calloc(1, sizeof(slab_thread_t))) == 0) {
+            perror("calloc");
+            exit(1);
+        }
+        record->next = slab_threads;
+        slab_threads = record;
+    }
+    record->in_use = 1;
+    pthread_mutex_unlock(&slab_mutex);
+
+    pthread_setspecific(slab_key, record);
+    slab_self = record;
+    return record;
+}
+
+// Gives the thread a fresh chunk to carve objects from. Returns 0 if memory
+// runs out.
+static int slab_refill(slab_thread_t *self) {
+    chunk_t *chunk;
+
+    if (posix_memalign((void **)&chunk, SLAB_CLASS_SIZE, SLAB_CHUNK_SIZE)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&slab_mutex);
+    chunk->next = slab_chunks;
+    slab_chunks = chunk;
+    __atomic_store_n(&slab_num_chunks, slab_num_chunks + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&slab_mutex);
+
+    self->bump = (char *)chunk + SLAB_CLASS_SIZE;
+    self->bump_end = (char *)chunk + SLAB_CHUNK_SIZE;
+    return 1;
+}
+
+/* Allocates an object of the given size, aligned to SLAB_CLASS_SIZE.
+ * Returns 0 if size is larger than SLAB_MAX_SIZE or memory runs out. */
+void *slab_alloc(size_t size) {
+    slab_thread_t *self = slab_self ? slab_self : slab_register();
+    int class;
+    size_t class_size;
+    void *object;
+
+    if (size == 0 || size > SLAB_MAX_SIZE) return 0;
+    class = (size - 1) / SLAB_CLASS_SIZE;
+    class_size = (class + 1) * SLAB_CLASS_SIZE;
+
+    if (self->free_lists[class] != 0) {
+        object = self->free_lists[class];
+        self->free_lists[class] = self->free_lists[class]->next;
+    } else {
+        if (self->bump_end - self->bump < (long)class_size &&
+            !slab_refill(self)) {
+            return 0;
+        }
+        object = self->bump;
+        self->bump += class_size;
+    }
+
+    __atomic_store_n(&self->in_use_bytes, self->in_use_bytes + class_size,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&self->requested_bytes, self->requested_bytes + size,
+                     __ATOMIC_RELAXED);
+    return object;
+}
+
+/* Frees an object returned by slab_alloc, which must be given the same
+ * size. */
+void slab_free(void *object, size_t size) {
+    slab_thread_t *self = slab_self ? slab_self : slab_register();
+    int class = (size - 1) / SLAB_CLASS_SIZE;
+    size_t class_size = (class + 1) * SLAB_CLASS_SIZE;
+    free_object_t *free_object = (free_object_t *)object;
+
+    free_object->next = self->free_lists[class];
+    self->free_lists[class] = free_object;
+
+    __atomic_store_n(&self->in_use_bytes, self->in_use_bytes - class_size,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&self->requested_bytes, self->requested_bytes - size,
+                     __ATOMIC_RELAXED);
+}
+
+/* Lets an object returned by slab_alloc with the given size be used for
+ * new_size bytes instead, if both sizes are in the same size class: returns
+ * 1 if so (the object must be freed with new_size from then on), 0 if it
+ * needs to be allocated anew. Nothing is moved. */
+int slab_resize(void *object, size_t size, size_t new_size) {
+    slab_thread_t *self = slab_self ? slab_self : slab_register();
+
+    (void)object;
+    if (new_size == 0 || (size - 1) / SLAB_CLASS_SIZE !=
+                             (new_size - 1) / SLAB_CLASS_SIZE) {
+        return 0;
+    }
+
+    __atomic_store_n(&self->requested_bytes,
+                     self->requested_bytes - size + new_size,
+                     __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* Frees every object ever allocated at once, returning all chunks to
+ * malloc. No thread may be using the allocator, or any object from it,
+ * when this is called. */
+void slab_release_all(void) {
+    slab_thread_t *record;
+    chunk_t *chunk;
+
+    pthread_mutex_lock(&slab_mutex);
+    while ((chunk = slab_chunks) != 0) {
+        slab_chunks = chunk->next;
+        free(chunk);
+    }
+    slab_num_chunks = 0;
+
+    for (record = slab_threads; record != 0; record = record->next) {
+        for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+            record->free_lists[i] = 0;
+        }
+        record->bump = 0;
+        record->bump_end = 0;
+        record->in_use_bytes = 0;
+        record->requested_bytes = 0;
+    }
+    pthread_mutex_unlock(&slab_mutex);
+}
+
+/* Sums up the memory statistics of all threads. The counters are read
+ * without stopping anyone, so the totals are approximate while threads are
+ * allocating. */
+void slab_get_stats(slab_stats_t *stats) {
+    slab_thread_t *record;
+
+    stats->in_use = 0;
+    stats->requested = 0;
+
+    pthread_mutex_lock(&slab_mutex);
+    stats->reserved = slab_num_chunks * SLAB_CHUNK_SIZE;
+    for (record = slab_threads; record != 0; record = record->next) {
+        stats->in_use +=
+            __atomic_load_n(&record->in_use_bytes, __ATOMIC_RELAXED);
+        stats->requested +=
+            __atomic_load_n(&record->requested_bytes, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&slab_mutex);
+
+    stats->fragmentation =
+        stats->reserved ? 1.0 - (double)stats->requested / stats->reserved : 0;
+}
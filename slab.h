@@ -0,0 +1,32 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <stddef.h>
+
+/*
+ * Slab allocator for the database's nodes. Each thread carves objects out of
+ * its own chunks and keeps its own free lists, one per size class, so that
+ * adding and removing keys does not go through the global malloc. Objects
+ * freed by another thread than the one that allocated them simply join the
+ * freeing thread's lists.
+ */
+
+// Objects are rounded up to a multiple of SLAB_CLASS_SIZE, and may be at
+// most SLAB_MAX_SIZE bytes long
+#define SLAB_CLASS_SIZE 16
+#define SLAB_MAX_SIZE 1024
+
+typedef struct slab_stats {
+    unsigned long reserved;   // Bytes taken from malloc, in whole chunks
+    unsigned long in_use;     // Bytes handed out, rounded up to size classes
+    unsigned long requested;  // Bytes actually asked for by live objects
+    double fragmentation;     // Share of the reserved bytes not requested
+} slab_stats_t;
+
+void *slab_alloc(size_t size);
+void slab_free(void *object, size_t size);
+int slab_resize(void *object, size_t size, size_t new_size);
+void slab_release_all(void);
+void slab_get_stats(slab_stats_t *stats);
+
+#endif  // SLAB_H_
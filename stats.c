@@ -0,0 +1,227 @@
+#include "./stats.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Per-thread counters. Records are never freed; when a thread exits, its
+// record is handed to the next thread that registers, which carries on
+// counting from where it left off, so that the totals never go down.
+typedef struct stats_thread {
+    stats_t stats;  // First, so that a record is its counters
+    int in_use;
+    struct stats_thread *next;
+} stats_thread_t;
+
+__thread stats_t *stats_self;
+
+static stats_thread_t *stats_threads;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+unsigned long long stats_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Called on thread exit to give up the thread's record
+static void stats_thread_exit(void *arg) {
+    stats_thread_t *record = (stats_thread_t *)arg;
+
+    pthread_mutex_lock(&stats_mutex);
+    record->in_use = 0;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+static void stats_key_create(void) {
+    int error;
+
+    if ((error = pthread_key_create(&stats_key, stats_thread_exit))) {
+        errno = error;
+        perror("pthread_key_create");
+        exit(1);
+    }
+}
+
+// Gives the calling thread a record, see stats_local
+stats_t *stats_register(void) {
+    stats_thread_t *record;
+
+    pthread_once(&stats_once, stats_key_create);
+
+    pthread_mutex_lock(&stats_mutex);
+    for (record = stats_threads; record != 0; record = record->next) {
+        if (!record->in_use) break;
+    }
+    if (record == 0) {
+        if ((record = calloc(1, sizeof(stats_thread_t))) == 0) {
+            perror("calloc");
+            exit(1);
+        }
+        record->next = stats_threads;
+        stats_threads = record;
+    }
+    record->in_use = 1;
+    pthread_mutex_unlock(&stats_mutex);
+
+    pthread_setspecific(stats_key, record);
+    stats_self = &record->stats;
+    return stats_self;
+}
+
+// Adds n counters of a record's to the totals
+static void stats_sum(unsigned long *totals, const unsigned long *counters,
+                      int n) {
+    for (int i = 0; i < n; i++) {
+        totals[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+    }
+}
+
+#ifdef LOCK_PROFILE
+// Adds n levels of lock counters of a record's to the totals
+static void stats_sum_levels(stats_lock_level_t *totals,
+                             const stats_lock_level_t *levels, int n) {
+    for (int i = 0; i < n; i++) {
+        totals[i].locks += __atomic_load_n(&levels[i].locks, __ATOMIC_RELAXED);
+        totals[i].waits += __atomic_load_n(&levels[i].waits, __ATOMIC_RELAXED);
+        totals[i].wait_ns +=
+            __atomic_load_n(&levels[i].wait_ns, __ATOMIC_RELAXED);
+        totals[i].holds += __atomic_load_n(&levels[i].holds, __ATOMIC_RELAXED);
+        totals[i].hold_ns +=
+            __atomic_load_n(&levels[i].hold_ns, __ATOMIC_RELAXED);
+    }
+}
+#endif
+
+/* Sums up the counters of all threads. They are read while their threads
+ * go on counting, so the totals are only approximate while anyone is busy.
+ * Take the difference of two calls to count what happened in between. */
+void stats_get(stats_t *stats) {
+    stats_thread_t *record;
+
+    memset(stats, 0, sizeof(stats_t));
+
+    pthread_mutex_lock(&stats_mutex);
+    for (record = stats_threads; record != 0; record = record->next) {
+        stats->locks += __atomic_load_n(&record->stats.locks, __ATOMIC_RELAXED);
+        stats->lock_waits +=
+            __atomic_load_n(&record->stats.lock_waits, __ATOMIC_RELAXED);
+        stats->lock_wait_ns +=
+            __atomic_load_n(&record->stats.lock_wait_ns, __ATOMIC_RELAXED);
+        stats->keys += __atomic_load_n(&record->stats.keys, __ATOMIC_RELAXED);
+        stats->cache_hits +=
+            __atomic_load_n(&record->stats.cache_hits, __ATOMIC_RELAXED);
+        stats->cache_misses +=
+            __atomic_load_n(&record->stats.cache_misses, __ATOMIC_RELAXED);
+        for (int i = 0; i < STATS_COMMANDS; i++) {
+            stats->commands[i] +=
+                __atomic_load_n(&record->stats.commands[i], __ATOMIC_RELAXED);
+            stats->command_ns[i] += __atomic_load_n(
+                &record->stats.command_ns[i], __ATOMIC_RELAXED);
+            stats_sum(stats->latency[i], record->stats.latency[i],
+                      STATS_HIST_BUCKETS);
+        }
+#ifdef LOCK_PROFILE
+        stats_sum_levels(stats->lock_levels[0], record->stats.lock_levels[0],
+                         2 * STATS_LOCK_LEVELS);
+#endif
+    }
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+// The latency histogram bucket counting ns
+int stats_bucket(unsigned long long ns) {
+    int shift;
+
+    if (ns < STATS_HIST_SUB) return ns;
+    shift = 63 - __builtin_clzll(ns) - STATS_HIST_SUB_BITS;
+    return ((shift + 1) << STATS_HIST_SUB_BITS) + (ns >> shift) -
+           STATS_HIST_SUB;
+}
+
+// The smallest latency, in nanoseconds, counted in bucket
+unsigned long long stats_bucket_ns(int bucket) {
+    int shift = (bucket >> STATS_HIST_SUB_BITS) - 1;
+
+    if (shift < 0) return bucket;
+    return (unsigned long long)((bucket & (STATS_HIST_SUB - 1)) +
+                                STATS_HIST_SUB)
+           << shift;
+}
+
+// Counts a command starting with letter, which took ns nanoseconds
+void stats_command(int letter, unsigned long long ns) {
+    stats_t *stats = stats_local();
+    const char *found = strchr(STATS_COMMAND_LETTERS, letter);
+    int i = letter != '\0' && found != NULL ? found - STATS_COMMAND_LETTERS
+                                            : STATS_COMMANDS - 1;
+
+    STATS_ADD(stats->commands[i], 1);
+    STATS_ADD(stats->command_ns[i], ns);
+    STATS_ADD(stats->latency[i][stats_bucket(ns)], 1);
+}
+
+/* Returns the latency, in microseconds, under which the given share of the
+ * latencies histogrammed in latency fall (to within the width of a bucket,
+ * rounding up), or 0 if there are none. */
+double stats_percentile(const unsigned long *latency, double share) {
+    unsigned long n = 0;
+    unsigned long rank;
+    unsigned long seen = 0;
+
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++) n += latency[i];
+    if (n == 0) return 0;
+
+    rank = share * n < n ? share * n : n - 1;
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+        if ((seen += latency[i]) > rank) return stats_bucket_ns(i + 1) / 1e3;
+    }
+    return 0;
+}
+
+#ifdef LOCK_PROFILE
+/* Prints the node locks counted in after but not in before (which may be
+ * NULL, to print all of them), a line per level and mode that saw any. */
+void stats_lock_report(FILE *out, const stats_t *before, const stats_t *after) {
+    static const stats_lock_level_t none;
+    static const char *modes[] = {"read", "write"};
+    const stats_lock_level_t *from;
+    const stats_lock_level_t *to;
+    unsigned long long locks;
+    unsigned long long waits;
+    unsigned long long holds;
+    double wait_ms;
+    double hold_ms;
+
+    fprintf(out, "%-5s %5s %12s %11s %7s %10s %12s %10s %12s\n", "mode",
+            "level", "locks", "waits", "waited", "ns/wait", "wait ms",
+            "ns/hold", "hold ms");
+    for (int mode = 0; mode < 2; mode++) {
+        for (int i = STATS_LOCK_LEVELS - 1; i >= 0; i--) {
+            from = before != NULL ? &before->lock_levels[mode][i] : &none;
+            to = &after->lock_levels[mode][i];
+            if ((locks = to->locks - from->locks) == 0) continue;
+            waits = to->waits - from->waits;
+            holds = to->holds - from->holds;
+            wait_ms = (to->wait_ns - from->wait_ns) / 1e6;
+            hold_ms = (to->hold_ns - from->hold_ns) / 1e6;
+
+            fprintf(out, "%-5s ", modes[mode]);
+            if (i == 0) {
+                fprintf(out, "%5s ", "head");
+            } else {
+                fprintf(out, "%5d ", i);
+            }
+            fprintf(out, "%12llu %11llu %6.2f%% %10.0f %12.1f %10.0f %12.1f\n",
+                    locks, waits, 100.0 * waits / locks,
+                    waits > 0 ? 1e6 * wait_ms / waits : 0, wait_ms,
+                    holds > 0 ? 1e6 * hold_ms / holds : 0, hold_ms);
+        }
+    }
+}
+#endif
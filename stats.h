@@ -0,0 +1,79 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+/*
+ * Statistics kept by every thread in counters of its own, so that keeping
+ * them adds no contention: only the owning thread writes its counters, and
+ * stats_get sums them up over all threads, past and present, without
+ * stopping anyone.
+ */
+
+// Commands are counted by the letter they start with, the last count
+// being for anything else
+#define STATS_COMMAND_LETTERS "qadusrmfl"
+#define STATS_COMMANDS 10
+
+// Command latencies are histogrammed in nanoseconds, in buckets covering
+// each power of two with STATS_HIST_SUB of them, so to within about 6%
+// (bench.c histograms its latencies the same way)
+#define STATS_HIST_SUB_BITS 4
+#define STATS_HIST_SUB (1 << STATS_HIST_SUB_BITS)
+#define STATS_HIST_BUCKETS \
+    ((64 - STATS_HIST_SUB_BITS + 1) << STATS_HIST_SUB_BITS)
+
+#ifdef LOCK_PROFILE
+#include <stdio.h>
+
+// Built with LOCK_PROFILE, node locks are also counted by the level of the
+// tree their node is at (see profile_lock in db.c) and by mode, read or
+// write, along with how long they were waited for and held. Taller nodes
+// than the last level are counted in it.
+#define STATS_LOCK_LEVELS 48
+
+typedef struct stats_lock_level {
+    unsigned long long locks;
+    unsigned long long waits;    // Of which had to wait for another
+    unsigned long long wait_ns;  // Time spent waiting for them
+    unsigned long long holds;    // Of which were timed until released
+    unsigned long long hold_ns;  // Time they were held for
+} stats_lock_level_t;
+#endif
+
+typedef struct stats {
+    unsigned long locks;              // Node locks taken
+    unsigned long lock_waits;         // Of which had to wait for another
+    unsigned long long lock_wait_ns;  // Time spent waiting for them
+    long keys;                        // Keys added less keys removed
+    unsigned long cache_hits;         // Lookups answered by the cache
+    unsigned long cache_misses;       // And those it had to pass on
+    unsigned long commands[STATS_COMMANDS];
+    unsigned long long command_ns[STATS_COMMANDS];  // Time spent on them
+    unsigned long latency[STATS_COMMANDS][STATS_HIST_BUCKETS];
+#ifdef LOCK_PROFILE
+    stats_lock_level_t lock_levels[2][STATS_LOCK_LEVELS];  // Read, write
+#endif
+} stats_t;
+
+extern __thread stats_t *stats_self;
+
+stats_t *stats_register(void);
+void stats_get(stats_t *stats);
+unsigned long long stats_now_ns(void);
+void stats_command(int letter, unsigned long long ns);
+int stats_bucket(unsigned long long ns);
+unsigned long long stats_bucket_ns(int bucket);
+double stats_percentile(const unsigned long *latency, double share);
+#ifdef LOCK_PROFILE
+void stats_lock_report(FILE *out, const stats_t *before, const stats_t *after);
+#endif
+
+// The calling thread's counters
+static inline stats_t *stats_local(void) {
+    return stats_self != 0 ? stats_self : stats_register();
+}
+
+// Adds n to a counter of the calling thread's, which others may be reading
+#define STATS_ADD(counter, n) \
+    __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+
+#endif  // STATS_H_
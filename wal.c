@@ -0,0 +1,398 @@
+#include "./wal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "./db.h"
+
+/*
+ * A record is a header of WAL_HEADER_LEN bytes, big-endian like the binary
+ * protocol, followed by the key and the value (empty for WAL_REMOVE):
+ *
+ *   0  type       1 byte
+ *   1  key_len    2 bytes
+ *   3  value_len  2 bytes
+ *   5  checksum   4 bytes, FNV-1a of the rest of the record
+ *
+ * A crash may leave the last records torn; replay stops at the first record
+ * that is cut short or fails its checksum, and cuts the log there.
+ */
+#define WAL_HEADER_LEN 9
+#define WAL_MAX_FIELD 0xffff
+
+// Initial size of the buffers records are appended to
+#define WAL_BUFLEN (64 * 1024)
+
+typedef struct wal_buffer {
+    char *data;
+    size_t len;
+    size_t capacity;
+} wal_buffer_t;
+
+/*
+ * Positions in the log (LSNs) count the bytes ever appended, and are kept
+ * from one log to the next so that no thread is left waiting on a stale one.
+ * Records are appended to one buffer while the committing thread (the
+ * leader) writes out the other, so appending never waits for the disk.
+ */
+static struct {
+    int fd;  // -1 while no log is open
+    int policy;
+    pthread_mutex_t mutex;
+    pthread_cond_t committed_cond;  // Signalled when a leader is done
+    wal_buffer_t buffers[2];
+    int current;  // Buffer appended to
+    int leading;  // Whether some thread is writing out the other buffer
+    unsigned long appended;   // LSN of the end of the last record
+    unsigned long committed;  // LSN up to which records are committed
+    unsigned long synced;     // LSN up to which records are synced
+    off_t base;               // Length of the log when opened
+    unsigned long base_lsn;   // LSN at that point
+
+    // Periodic syncing
+    pthread_t syncer;
+    pthread_cond_t stop_cond;
+    int stopping;
+
+    wal_stats_t stats;
+} wal = {.fd = -1,
+         .mutex = PTHREAD_MUTEX_INITIALIZER,
+         .committed_cond = PTHREAD_COND_INITIALIZER,
+         .stop_cond = PTHREAD_COND_INITIALIZER};
+
+// End of the last record appended by this thread
+static __thread unsigned long wal_thread_lsn;
+
+static void put_u16(unsigned char *p, unsigned v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static unsigned get_u16(const unsigned char *p) {
+    return (unsigned)p[0] << 8 | p[1];
+}
+
+static unsigned long fnv1a(unsigned long hash, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash = ((hash ^ (unsigned char)data[i]) * 16777619UL) & 0xffffffffUL;
+    }
+    return hash;
+}
+
+static unsigned long record_checksum(const unsigned char *header,
+                                     const char *key, size_t key_len,
+                                     const char *value, size_t value_len) {
+    unsigned long hash = 2166136261UL;
+
+    hash = fnv1a(hash, (const char *)header, 5);
+    hash = fnv1a(hash, key, key_len);
+    return fnv1a(hash, value, value_len);
+}
+
+static void write_all(int fd, const char *data, size_t len) {
+    ssize_t ret;
+
+    while (len > 0) {
+        if ((ret = write(fd, data, len)) < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            exit(1);
+        }
+        data += ret;
+        len -= ret;
+    }
+}
+
+static void sync_log(int fd) {
+    if (fdatasync(fd) < 0) {
+        perror("fdatasync");
+        exit(1);
+    }
+}
+
+/* Applies the records in the log at path from offset start on to the
+ * database, returning the length of the part of the log holding whole,
+ * valid records. */
+static off_t replay(const char *path, off_t start) {
+    unsigned char header[WAL_HEADER_LEN];
+    char key[WAL_MAX_FIELD + 1];
+    char value[WAL_MAX_FIELD + 1];
+    size_t key_len;
+    size_t value_len;
+    unsigned long checksum;
+    off_t valid = start;
+    FILE *file;
+
+    if ((file = fopen(path, "r")) == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    if (fseeko(file, start, SEEK_SET) < 0) {
+        perror("fseeko");
+        exit(1);
+    }
+
+    while (fread(header, 1, WAL_HEADER_LEN, file) == WAL_HEADER_LEN) {
+        key_len = get_u16(&header[1]);
+        value_len = get_u16(&header[3]);
+        checksum = (unsigned long)get_u16(&header[5]) << 16 |
+                   get_u16(&header[7]);
+        if (fread(key, 1, key_len, file) != key_len ||
+            fread(value, 1, value_len, file) != value_len ||
+            record_checksum(header, key, key_len, value, value_len) !=
+                checksum) {
+            break;
+        }
+        key[key_len] = '\0';
+        value[value_len] = '\0';
+
+        if (header[0] == WAL_ADD) {
+            db_add(key, value);
+        } else if (header[0] == WAL_REMOVE) {
+            db_remove(key);
+        } else if (header[0] == WAL_SET) {
+            db_upsert(key, value);
+        } else {
+            break;
+        }
+        valid += WAL_HEADER_LEN + key_len + value_len;
+    }
+
+    fclose(file);
+    return valid;
+}
+
+// Syncs the log every WAL_SYNC_INTERVAL_MS until wal_close
+static void *run_syncer(void *arg) {
+    (void)arg;
+    struct timespec deadline;
+    unsigned long committed;
+
+    pthread_mutex_lock(&wal.mutex);
+    while (!wal.stopping) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WAL_SYNC_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&wal.stop_cond, &wal.mutex, &deadline);
+
+        if (wal.stopping || wal.synced == wal.committed) continue;
+        committed = wal.committed;
+        pthread_mutex_unlock(&wal.mutex);
+        sync_log(wal.fd);
+        pthread_mutex_lock(&wal.mutex);
+        if (wal.synced < committed) wal.synced = committed;
+        wal.stats.syncs++;
+    }
+    pthread_mutex_unlock(&wal.mutex);
+    return NULL;
+}
+
+/* Replays the log at path (created if need be) into the database, from
+ * offset start on (see wal_checkpoint), then logs every change made to the
+ * database to it from now on, made durable according to policy. Returns 0,
+ * or -1 if the log cannot be opened. */
+int wal_open(const char *path, int policy, off_t start) {
+    struct stat st;
+    int fd;
+    int error;
+    off_t valid;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        exit(1);
+    }
+
+    // A log shorter than start is not the one the snapshot was taken with,
+    // and holds no change it is missing
+    if (st.st_size < start) start = st.st_size;
+
+    // Changes are not logged yet, so replaying them does not log them again
+    valid = replay(path, start);
+    if (ftruncate(fd, valid) < 0) {
+        perror("ftruncate");
+        exit(1);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        wal.buffers[i].len = 0;
+        wal.buffers[i].capacity = WAL_BUFLEN;
+        if ((wal.buffers[i].data = malloc(WAL_BUFLEN)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    wal.current = 0;
+    wal.leading = 0;
+    wal.base = valid;
+    wal.base_lsn = wal.appended;
+    memset(&wal.stats, 0, sizeof(wal.stats));
+    wal.policy = policy;
+    wal.stopping = 0;
+    wal.fd = fd;
+
+    if (policy == WAL_SYNC_PERIODIC &&
+        (error = pthread_create(&wal.syncer, 0, run_syncer, NULL))) {
+        errno = error;
+        perror("pthread_create");
+        exit(1);
+    }
+    return 0;
+}
+
+/* Appends a record of a change to the log, to be written out by the next
+ * wal_commit. Called with the nodes the change touches still locked. Does
+ * nothing if no log is open. */
+void wal_append(int type, const char *key, size_t key_len, const char *value,
+                size_t value_len) {
+    unsigned char header[WAL_HEADER_LEN];
+    unsigned long checksum;
+    size_t len = WAL_HEADER_LEN + key_len + value_len;
+    wal_buffer_t *buffer;
+    char *data;
+
+    if (wal.fd < 0) return;
+
+    header[0] = type;
+    put_u16(&header[1], key_len);
+    put_u16(&header[3], value_len);
+    checksum = record_checksum(header, key, key_len, value, value_len);
+    put_u16(&header[5], checksum >> 16);
+    put_u16(&header[7], checksum);
+
+    pthread_mutex_lock(&wal.mutex);
+    buffer = &wal.buffers[wal.current];
+    if (buffer->len + len > buffer->capacity) {
+        while (buffer->len + len > buffer->capacity) buffer->capacity *= 2;
+        if ((data = realloc(buffer->data, buffer->capacity)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        buffer->data = data;
+    }
+    data = &buffer->data[buffer->len];
+    memcpy(data, header, WAL_HEADER_LEN);
+    memcpy(data + WAL_HEADER_LEN, key, key_len);
+    memcpy(data + WAL_HEADER_LEN + key_len, value, value_len);
+    buffer->len += len;
+
+    wal.appended += len;
+    wal_thread_lsn = wal.appended;
+    wal.stats.records++;
+    wal.stats.bytes += len;
+    pthread_mutex_unlock(&wal.mutex);
+}
+
+/* Returns once every record appended by this thread is committed: written
+ * to the log, and synced if the policy is WAL_SYNC_ALWAYS. Whichever thread
+ * finds no write in progress leads the next one, writing out the records of
+ * every thread that has appended since the last; the others wait for it. */
+void wal_commit(void) {
+    wal_buffer_t *buffer;
+    unsigned long target;
+    int cancel_state;
+
+    if (wal.fd < 0 ||
+        __atomic_load_n(&wal.committed, __ATOMIC_ACQUIRE) >= wal_thread_lsn) {
+        return;
+    }
+
+    // Waiting on the condition variable is a cancellation point, and a
+    // leader cancelled halfway would leave the others waiting forever
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+    pthread_mutex_lock(&wal.mutex);
+    while (wal.committed < wal_thread_lsn) {
+        if (wal.leading) {
+            pthread_cond_wait(&wal.committed_cond, &wal.mutex);
+            continue;
+        }
+
+        wal.leading = 1;
+        buffer = &wal.buffers[wal.current];
+        wal.current = !wal.current;
+        target = wal.appended;
+        pthread_mutex_unlock(&wal.mutex);
+
+        write_all(wal.fd, buffer->data, buffer->len);
+        buffer->len = 0;
+        if (wal.policy == WAL_SYNC_ALWAYS) sync_log(wal.fd);
+
+        pthread_mutex_lock(&wal.mutex);
+        wal.stats.writes++;
+        if (wal.policy == WAL_SYNC_ALWAYS) {
+            wal.stats.syncs++;
+            wal.synced = target;
+        }
+        __atomic_store_n(&wal.committed, target, __ATOMIC_RELEASE);
+        wal.leading = 0;
+        pthread_cond_broadcast(&wal.committed_cond);
+    }
+    pthread_mutex_unlock(&wal.mutex);
+    pthread_setcancelstate(cancel_state, NULL);
+}
+
+/* Writes out and syncs every record appended so far, returning the length
+ * of the log they make up, or 0 if no log is open. A snapshot of the
+ * database taken after this holds every change recorded before that
+ * offset, so recovering it only takes replaying the log from there on. */
+off_t wal_checkpoint(void) {
+    unsigned long lsn;
+
+    if (wal.fd < 0) return 0;
+
+    pthread_mutex_lock(&wal.mutex);
+    lsn = wal_thread_lsn = wal.appended;
+    pthread_mutex_unlock(&wal.mutex);
+
+    wal_commit();
+    if (wal.policy != WAL_SYNC_ALWAYS) {
+        sync_log(wal.fd);
+        pthread_mutex_lock(&wal.mutex);
+        if (wal.synced < lsn) wal.synced = lsn;
+        wal.stats.syncs++;
+        pthread_mutex_unlock(&wal.mutex);
+    }
+    return wal.base + (off_t)(lsn - wal.base_lsn);
+}
+
+/* Writes out and syncs every record appended so far and closes the log.
+ * Nothing may change the database meanwhile. */
+void wal_close(void) {
+    int error;
+
+    if (wal.fd < 0) return;
+
+    wal_thread_lsn = wal.appended;
+    wal_commit();
+
+    if (wal.policy == WAL_SYNC_PERIODIC) {
+        pthread_mutex_lock(&wal.mutex);
+        wal.stopping = 1;
+        pthread_cond_signal(&wal.stop_cond);
+        pthread_mutex_unlock(&wal.mutex);
+        if ((error = pthread_join(wal.syncer, NULL))) {
+            errno = error;
+            perror("pthread_join");
+            exit(1);
+        }
+    }
+
+    sync_log(wal.fd);
+    close(wal.fd);
+    wal.fd = -1;
+    for (int i = 0; i < 2; i++) free(wal.buffers[i].data);
+}
+
+void wal_get_stats(wal_stats_t *stats) {
+    pthread_mutex_lock(&wal.mutex);
+    *stats = wal.stats;
+    pthread_mutex_unlock(&wal.mutex);
+}
@@ -0,0 +1,47 @@
+#ifndef WAL_H_
+#define WAL_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Write-ahead log. Every change to the database is appended to the log while
+ * the nodes it touches are still locked, so the log holds the changes to
+ * each key in the order they were made; replaying the log into an empty
+ * database rebuilds it.
+ *
+ * Appending only copies the record to memory. Writing it out is left to
+ * wal_commit, which a thread calls before acknowledging its changes: one
+ * committing thread at a time writes out everything appended so far, by
+ * anyone, while the others wait for it (group commit), so concurrent
+ * writers share their writes and syncs.
+ */
+
+// How committed changes are made durable
+#define WAL_SYNC_NONE 0      // Written to the file, surviving a server crash
+#define WAL_SYNC_PERIODIC 1  // And synced every WAL_SYNC_INTERVAL_MS
+#define WAL_SYNC_ALWAYS 2    // And synced before wal_commit returns
+
+#define WAL_SYNC_INTERVAL_MS 100
+
+// Kinds of records, named after the commands making them
+#define WAL_ADD 'a'
+#define WAL_REMOVE 'd'
+#define WAL_SET 's'
+
+typedef struct wal_stats {
+    unsigned long records;  // Records appended
+    unsigned long bytes;    // Bytes appended
+    unsigned long writes;   // Group writes to the file
+    unsigned long syncs;    // Syncs of the file
+} wal_stats_t;
+
+int wal_open(const char *path, int policy, off_t start);
+void wal_append(int type, const char *key, size_t key_len, const char *value,
+                size_t value_len);
+void wal_commit(void);
+off_t wal_checkpoint(void);
+void wal_close(void);
+void wal_get_stats(wal_stats_t *stats);
+
+#endif  // WAL_H_
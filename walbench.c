@@ -0,0 +1,149 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "./db.h"
+#include "./wal.h"
+
+/*
+ * Benchmark for the write-ahead log. Threads add keys to the database, each
+ * committing its change to the log before the next one as a server worker
+ * does before responding, first with no log at all and then with a log at
+ * each sync policy. Write throughput is reported for each, along with how
+ * many records group commit gathered into each write and each sync.
+ */
+
+typedef struct level {
+    const char *name;
+    int policy;  // -1 for no log
+} level_t;
+
+static const level_t levels[] = {{"no log", -1},
+                                 {"none", WAL_SYNC_NONE},
+                                 {"periodic", WAL_SYNC_PERIODIC},
+                                 {"always", WAL_SYNC_ALWAYS}};
+
+static int num_ops;
+
+/*
+ * Returns the current time in nanoseconds.
+ */
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Adds num_ops keys of its own, committing each before the next.
+ */
+static void *run_writer(void *arg) {
+    long id = (long)arg;
+    char key[32];
+
+    for (int i = 0; i < num_ops; i++) {
+        snprintf(key, sizeof(key), "key%03ld-%08d", id, i);
+        if (!db_add(key, key)) {
+            fprintf(stderr, "failed to add %s\n", key);
+            exit(1);
+        }
+        wal_commit();
+    }
+    return NULL;
+}
+
+/*
+ * Runs the writers against a fresh database and log at the given level.
+ */
+static void run(const level_t *level, const char *path, int num_threads) {
+    pthread_t *threads;
+    wal_stats_t stats;
+    double elapsed;
+    int error;
+
+    if ((threads = malloc(num_threads * sizeof(pthread_t))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    if (level->policy >= 0) {
+        if (unlink(path) < 0 && errno != ENOENT) {
+            perror(path);
+            exit(1);
+        }
+        if (wal_open(path, level->policy, 0) < 0) {
+            perror(path);
+            exit(1);
+        }
+    }
+
+    elapsed = now_ns();
+    for (long i = 0; i < num_threads; i++) {
+        if ((error = pthread_create(&threads[i], 0, run_writer, (void *)i))) {
+            errno = error;
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        if ((error = pthread_join(threads[i], NULL))) {
+            errno = error;
+            perror("pthread_join");
+            exit(1);
+        }
+    }
+    elapsed = now_ns() - elapsed;
+
+    printf("%-10s %12.0f ops/s", level->name,
+           1e9 * num_threads * num_ops / elapsed);
+    if (level->policy >= 0) {
+        wal_get_stats(&stats);
+        printf(" %9lu writes %9.1f records/write %9lu syncs",
+               stats.writes, (double)stats.records / stats.writes,
+               stats.syncs);
+        if (stats.syncs > 0) {
+            printf(" %9.1f records/sync", (double)stats.records / stats.syncs);
+        }
+        wal_close();
+        unlink(path);
+    }
+    printf("\n");
+
+    db_cleanup();
+    free(threads);
+}
+
+/*
+ * The (optional) arguments are the number of threads, 8 by default, the
+ * number of keys each adds, 20000 by default, and the path of the log,
+ * walbench.log by default.
+ */
+int main(int argc, char *argv[]) {
+    int num_threads = 8;
+    const char *path = "walbench.log";
+
+    num_ops = 20000;
+    if (argc > 4) {
+        fprintf(stderr, "Usage: %s [threads] [ops per thread] [log]\n",
+                argv[0]);
+        return 1;
+    }
+    if (argc > 1 && (num_threads = atoi(argv[1])) <= 0) {
+        fprintf(stderr, "Invalid number of threads: %s\n", argv[1]);
+        return 1;
+    }
+    if (argc > 2 && (num_ops = atoi(argv[2])) <= 0) {
+        fprintf(stderr, "Invalid number of ops: %s\n", argv[2]);
+        return 1;
+    }
+    if (argc > 3) path = argv[3];
+
+    printf("%d threads, %d adds each\n", num_threads, num_ops);
+    for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        run(&levels[i], path, num_threads);
+    }
+    return 0;
+}